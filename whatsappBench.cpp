@@ -0,0 +1,689 @@
+
+// -------------------------------------------- Includes -------------------------------------------
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <libgen.h>
+#include <limits.h>
+#include "whatsappCore.h"
+#include "whatsappLatency.h"
+
+// Microbenchmarks of the server core, driven in-process over an in-memory transport - no sockets
+// and no event loop. With --rtt it measures instead the round trip of a request through a real
+// server over TCP on this host, with the default and with the low-latency profile. With --check it
+// runs scenarios over the same transport and checks the responses. Every result is printed as one
+// JSON object per line, so runs can be collected and compared over time.
+
+// -------------------------------------------- Defines --------------------------------------------
+
+#define INVALID_ARG "Usage: whatsappBench [clients ...]\n" \
+                    "       whatsappBench --rtt [samples]\n" \
+                    "       whatsappBench --check\n"
+#define RTT_OPT "--rtt"
+#define CHECK_OPT "--check"
+
+#define LOOKUP_OPS 1000000 // is_name_exist / is_member calls per scale.
+#define SEND_OPS 100000 // Direct and group sends per scale.
+#define EXIT_OPS 1000 // Every exit walks all the groups, so keep it small.
+#define GROUP_SIZE 10 // The members of every group, the creator included.
+#define CLIENTS_PER_GROUP 100 // One group for every CLIENTS_PER_GROUP clients.
+#define PREPARED_REQUESTS 4096 // Requests are built before the timing, and reused round robin.
+#define MESSAGE "hello from the benchmark"
+
+#define RSS_CLIENTS 2000 // The clients that connect, send and leave in every round of the memory check.
+#define RSS_WARMUP_ROUNDS 10 // The rounds that fill the pools and the histories.
+#define RSS_ROUNDS 40 // The rounds after the warmup, which must not grow the resident set.
+#define RSS_HISTORY_MSGS 4 // Short histories, so the warmup fills them.
+#define RSS_MAX_GROWTH_KB 512
+
+#define RTT_SAMPLES 10000 // Round trips per profile.
+#define RTT_WARMUP 200 // Round trips before the timing starts.
+#define RTT_PORT 48620 // The server of the first profile listens here, the next one on the next port.
+#define RTT_CONNECT_MS 2000 // How long to wait for the server to start listening.
+#define SERVER_NAME "whatsappServer" // Next to the benchmark binary.
+#define SELF_EXE "/proc/self/exe"
+#define MAX_HOST_NAME_LEN 30 // Like the server - it listens on the address of its host name.
+
+// ---------------------------------------- Global variables ---------------------------------------
+
+uint64_t delivered_msgs = 0; // Messages the core handed to the in-memory transport.
+uint64_t delivered_bytes = 0;
+
+uint64_t rand_state = 88172645463325252ULL; // Fixed seed, so every run does the same work.
+
+int captured_sock = -1; // The connection whose responses are kept in captured, -1 for none.
+std::string captured;
+
+// ------------------------------------------- Functions -------------------------------------------
+
+/**
+ * The in-memory transport - count what would have been sent, and keep it for the checks.
+ */
+ssize_t bench_send (int sock, const char* data, size_t length)
+{
+	if (sock == captured_sock){
+		captured.append(data, length);
+	}
+	delivered_msgs++;
+	delivered_bytes += length;
+	return (ssize_t) length;
+}
+
+/**
+ * The in-memory transport - a connection the core is done with only loses its session.
+ */
+void bench_disconnect (int sock)
+{
+	close_session(sock);
+}
+
+/**
+ * The in-memory transport - there is no connection to tell it is rejected.
+ */
+void bench_reject (int, uint64_t)
+{
+}
+
+/**
+ * The in-memory transport - there is no shared memory to attach.
+ */
+void bench_attach_shm (int)
+{
+}
+
+/**
+ * The in-memory transport - there is nowhere to spool an attachment.
+ */
+bool bench_receive_attachment (int, const std::vector<int>&, size_t, const std::string&)
+{
+	return false;
+}
+
+/**
+ * A fast pseudo random number (xorshift64).
+ */
+uint64_t next_rand ()
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return rand_state;
+}
+
+/**
+ * The current time in nanoseconds.
+ */
+uint64_t now_ns ()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Print the result of one benchmark.
+ * @param bench the benchmark name.
+ * @param clients the number of registered clients (the scale).
+ * @param ops the number of operations that were timed.
+ * @param elapsed_ns the time they took.
+ */
+void report (const char* bench, unsigned long clients, unsigned long ops, uint64_t elapsed_ns)
+{
+	printf("{\"bench\": \"%s\", \"clients\": %lu, \"ops\": %lu, \"ns_per_op\": %.1f, "
+	       "\"ops_per_s\": %.0f}\n", bench, clients, ops, (double) elapsed_ns / ops,
+	       ops * 1e9 / (elapsed_ns > 0 ? elapsed_ns : 1));
+	fflush(stdout);
+}
+
+/**
+ * Hand one request line to the core, as if it arrived on the given connection.
+ * @param sock the connection.
+ * @param request the request, without the end of line.
+ */
+void request (int sock, std::string request)
+{
+	request += END_LINE;
+	handle_client_request(&request[0], sock);
+}
+
+/**
+ * Return the name of the client registered on the given connection.
+ */
+std::string client_name (unsigned long i)
+{
+	std::ostringstream name;
+	name << "client" << i;
+	return name.str();
+}
+
+/**
+ * Return the name of the i-th group.
+ */
+std::string group_name (unsigned long i)
+{
+	std::ostringstream name;
+	name << "group" << i;
+	return name.str();
+}
+
+/**
+ * Drop all the sessions, clients, groups and histories, for the next scale.
+ */
+void reset_core ()
+{
+	while (!socketsToSessions.empty()){
+		close_session(socketsToSessions.begin()->first);
+	}
+	clientsToSockets.clear();
+	groupsToClients.clear();
+	conversationsToHistory.clear();
+	historyLru.clear();
+	clientsToConversations.clear();
+	departedClients.clear();
+	departures.clear();
+	history_bytes = 0;
+}
+
+/**
+ * Run all the benchmarks with the given number of clients.
+ * @param clients the number of clients to register.
+ */
+void run_scale (unsigned long clients)
+{
+	unsigned long groups = clients / CLIENTS_PER_GROUP > 0 ? clients / CLIENTS_PER_GROUP : 1;
+	std::vector<std::string> names(clients);
+	std::vector<std::string> requests(clients);
+	for (unsigned long i = 0; i < clients; i ++){
+		names[i] = client_name(i);
+		requests[i] = "name " + names[i];
+	}
+
+	// Registration - a new session and a "name" request for every client.
+	uint64_t start = now_ns();
+	for (unsigned long i = 0; i < clients; i ++){
+		open_session((int) i, TRANSPORT_TCP);
+		request((int) i, requests[i]);
+	}
+	report("register", clients, clients, now_ns() - start);
+
+	// Directory lookups - half of the names exist.
+	std::vector<std::string> lookups(PREPARED_REQUESTS);
+	for (unsigned long i = 0; i < lookups.size(); i ++){
+		lookups[i] = next_rand() % 2 ? names[next_rand() % clients] : "missing" + names[i % clients];
+	}
+	unsigned long found = 0;
+	start = now_ns();
+	for (unsigned long i = 0; i < LOOKUP_OPS; i ++){
+		found += is_name_exist(lookups[i % lookups.size()]) != NOT_EXIST;
+	}
+	report("is_name_exist", clients, LOOKUP_OPS, now_ns() - start);
+
+	// Group creation - client g * CLIENTS_PER_GROUP creates group g with the next clients.
+	std::vector<int> creators(groups);
+	for (unsigned long g = 0; g < groups; g ++){
+		unsigned long creator = (g * CLIENTS_PER_GROUP) % clients;
+		creators[g] = (int) creator;
+		requests[g] = "create_group " + group_name(g) + " ";
+		for (unsigned long m = 1; m < GROUP_SIZE; m ++){
+			requests[g] += names[(creator + m) % clients] + (m + 1 < GROUP_SIZE ? "," : "");
+		}
+	}
+	start = now_ns();
+	for (unsigned long g = 0; g < groups; g ++){
+		request(creators[g], requests[g]);
+	}
+	report("create_group", clients, groups, now_ns() - start);
+
+	// Membership checks - a random client in a random group.
+	std::vector<std::string> group_names(groups);
+	for (unsigned long g = 0; g < groups; g ++){
+		group_names[g] = group_name(g);
+	}
+	start = now_ns();
+	for (unsigned long i = 0; i < LOOKUP_OPS; i ++){
+		unsigned long g = i % groups;
+		found += is_member(names[(g * CLIENTS_PER_GROUP + i % (2 * GROUP_SIZE)) % clients], group_names[g]);
+	}
+	report("is_member", clients, LOOKUP_OPS, now_ns() - start);
+
+	// Direct sends between random clients.
+	std::vector<std::string> sends(PREPARED_REQUESTS);
+	for (unsigned long i = 0; i < sends.size(); i ++){
+		sends[i] = "send " + names[next_rand() % clients] + " " + MESSAGE;
+	}
+	start = now_ns();
+	for (unsigned long i = 0; i < SEND_OPS; i ++){
+		request((int) (next_rand() % clients), sends[i % sends.size()]);
+	}
+	report("send_direct", clients, SEND_OPS, now_ns() - start);
+
+	// Group sends - the creator sends to its group, which fans out to GROUP_SIZE - 1 members.
+	for (unsigned long g = 0; g < groups; g ++){
+		requests[g] = "send " + group_names[g] + " " + MESSAGE;
+	}
+	uint64_t fanout = delivered_msgs;
+	start = now_ns();
+	for (unsigned long i = 0; i < SEND_OPS; i ++){
+		request(creators[i % groups], requests[i % groups]);
+	}
+	uint64_t elapsed = now_ns() - start;
+	report("send_group", clients, SEND_OPS, elapsed);
+	fanout = delivered_msgs - fanout - SEND_OPS; // Without the responses to the sender.
+	report("send_group_per_delivery", clients, (unsigned long) fanout, elapsed);
+
+	// Exits - every exit removes the client from all the groups.
+	unsigned long exits = std::min((unsigned long) EXIT_OPS, clients);
+	start = now_ns();
+	for (unsigned long i = 0; i < exits; i ++){
+		request((int) (clients - 1 - i), "exit");
+	}
+	report("exit", clients, exits, now_ns() - start);
+
+	if (found == 0){ // Keep the lookups from being optimized away.
+		printf("{\"warning\": \"no lookup hit\"}\n");
+	}
+	reset_core();
+}
+
+/**
+ * Send a request and return the responses to it.
+ */
+std::string request_response (int sock, const std::string& line)
+{
+	captured_sock = sock;
+	captured.clear();
+	request(sock, line);
+	captured_sock = -1;
+	return captured;
+}
+
+/**
+ * Print the result of one check.
+ * @return ok.
+ */
+bool report_check (const char* check, bool ok, const std::string& got)
+{
+	printf("{\"check\": \"%s\", \"ok\": %s}\n", check, ok ? "true" : "false");
+	if (!ok){
+		fprintf(stderr, "%s: unexpected response:\n%s", check, got.c_str());
+	}
+	fflush(stdout);
+	return ok;
+}
+
+/**
+ * A client that exits and registers again within the grace period gets back its direct history
+ * and its groups (with what they got meanwhile). Past the grace period a client with the same name
+ * gets nothing.
+ * @return true if the check passed.
+ */
+bool check_history_reconnect ()
+{
+	const int alice = 0, bob = 1;
+	open_session(alice, TRANSPORT_TCP);
+	request(alice, "name alice");
+	open_session(bob, TRANSPORT_TCP);
+	request(bob, "name bob");
+	request(alice, "create_group team bob");
+	request(alice, "send bob hello");
+	request(alice, "send team before");
+	request(bob, "exit");
+	request(alice, "send team meanwhile");
+
+	open_session(bob, TRANSPORT_TCP);
+	request(bob, "name bob");
+	std::string direct = request_response(bob, "history alice");
+	std::string group = request_response(bob, "history team");
+	bool ok = report_check("history_reconnect_direct",
+	                       direct == "1 messages in the history of alice.\n1 alice: hello\n", direct);
+	ok = report_check("history_reconnect_group",
+	                  group == "2 messages in the history of team.\n"
+	                           "1 alice: before\n2 alice: meanwhile\n", group) && ok;
+
+	unsigned int grace_s = history_grace_s;
+	history_grace_s = 0; // The grace period is over as soon as it leaves.
+	request(bob, "exit");
+	history_grace_s = grace_s;
+	open_session(bob, TRANSPORT_TCP);
+	request(bob, "name bob");
+	direct = request_response(bob, "history alice");
+	group = request_response(bob, "history team");
+	ok = report_check("history_expired_direct",
+	                  direct == "0 messages in the history of alice.\n", direct) && ok;
+	ok = report_check("history_expired_group", group == "ERROR: failed to fetch history.\n", group) && ok;
+	reset_core();
+	return ok;
+}
+
+/**
+ * The resident set size of this process, from /proc/self/status.
+ * @return the size in KB, 0 if it can't be read.
+ */
+long rss_kb ()
+{
+	FILE* status = fopen("/proc/self/status", "r");
+	if (status == NULL){
+		return 0;
+	}
+	char line[256];
+	long kb = 0;
+	while (fgets(line, sizeof(line), status) != NULL){
+		if (sscanf(line, "VmRSS: %ld", &kb) == 1){
+			break;
+		}
+	}
+	fclose(status);
+	return kb;
+}
+
+/**
+ * Hand bytes to the core as if they arrived on the given connection - through its receive buffer,
+ * like the event loop does - and end the pass.
+ */
+void feed (int sock, const std::string& bytes)
+{
+	socketsToSessions[sock]->inbuf.append(bytes.data(), bytes.length());
+	serve_client_requests(sock);
+	arena_reset();
+}
+
+/**
+ * One round of churn - every client connects, sends a direct message and a message to its group,
+ * and leaves. The names repeat every round, like clients that come back.
+ */
+void churn_round (unsigned long round)
+{
+	std::string text(120, (char) ('a' + round % 26));
+	for (unsigned long i = 0; i < RSS_CLIENTS; i ++){
+		open_session((int) i, TRANSPORT_TCP);
+		feed((int) i, "name " + client_name(i) + END_LINE);
+	}
+	for (unsigned long g = 0; g < RSS_CLIENTS / GROUP_SIZE; g ++){
+		std::string members;
+		for (unsigned long m = 1; m < GROUP_SIZE; m ++){
+			members += client_name(g * GROUP_SIZE + m) + (m + 1 < GROUP_SIZE ? "," : "");
+		}
+		feed((int) (g * GROUP_SIZE), "create_group " + group_name(g) + " " + members + END_LINE);
+	}
+	for (unsigned long i = 0; i < RSS_CLIENTS; i ++){
+		feed((int) i, "send " + client_name((i + 1) % RSS_CLIENTS) + " " + text + END_LINE +
+		              "send " + group_name(i / GROUP_SIZE) + " " + text + END_LINE);
+	}
+	for (unsigned long i = 0; i < RSS_CLIENTS; i ++){
+		feed((int) i, "exit\n");
+	}
+}
+
+/**
+ * The memory of a long uptime stays bounded - once the pools and the histories are warm, rounds of
+ * clients that connect, send and leave do not grow the resident set.
+ * @return true if the check passed.
+ */
+bool check_bounded_rss ()
+{
+	unsigned int history_msgs = history_msgs_cap;
+	history_msgs_cap = RSS_HISTORY_MSGS;
+	for (unsigned long round = 0; round < RSS_WARMUP_ROUNDS; round ++){
+		churn_round(round);
+	}
+	long warm_kb = rss_kb();
+	for (unsigned long round = RSS_WARMUP_ROUNDS; round < RSS_WARMUP_ROUNDS + RSS_ROUNDS; round ++){
+		churn_round(round);
+	}
+	long end_kb = rss_kb();
+	history_msgs_cap = history_msgs;
+	printf("{\"bench\": \"rss\", \"clients\": %d, \"rounds\": %d, \"warm_kb\": %ld, \"end_kb\": %ld}\n",
+	       RSS_CLIENTS, RSS_ROUNDS, warm_kb, end_kb);
+	std::ostringstream got;
+	got << "grew from " << warm_kb << " KB to " << end_kb << " KB\n";
+	bool ok = report_check("bounded_rss", warm_kb > 0 && end_kb - warm_kb <= RSS_MAX_GROWTH_KB, got.str());
+	reset_core();
+	return ok;
+}
+
+/**
+ * The path of the server binary - SERVER_NAME in the directory of this binary, wherever it was
+ * started from.
+ */
+std::string server_path ()
+{
+	char path[PATH_MAX];
+	ssize_t length = readlink(SELF_EXE, path, sizeof(path) - 1);
+	if (length <= 0){
+		return std::string("./") + SERVER_NAME;
+	}
+	path[length] = '\0';
+	return std::string(dirname(path)) + "/" + SERVER_NAME;
+}
+
+/**
+ * Start a server for the round trip benchmark, with its stdin and stdout on /dev/null.
+ * @param port the port to listen on.
+ * @param options the extra server options.
+ * @return the server pid, or -1 on error.
+ */
+pid_t start_server (int port, const std::vector<std::string>& options)
+{
+	std::vector<std::string> args;
+	args.push_back(server_path());
+	std::ostringstream port_arg;
+	port_arg << port;
+	args.push_back(port_arg.str());
+	args.insert(args.end(), options.begin(), options.end());
+
+	pid_t pid = fork();
+	if (pid == 0){
+		int null_fd = open("/dev/null", O_RDWR);
+		dup2(null_fd, STDIN_FILENO);
+		dup2(null_fd, STDOUT_FILENO);
+		std::vector<char*> argv;
+		for (unsigned int i = 0; i < args.size(); i ++){
+			argv.push_back(const_cast<char*>(args[i].c_str()));
+		}
+		argv.push_back(NULL);
+		execv(argv[0], &argv[0]);
+		_exit(1);
+	}
+	return pid;
+}
+
+/**
+ * Read one line from a benchmark connection.
+ * @param sock the connection.
+ * @param inbuf the bytes of the connection that were read and not returned yet.
+ * @param profile the latency profile of the benchmark client.
+ * @return false if the server closed the connection.
+ */
+bool read_line (int sock, std::string& inbuf, const latency_profile& profile)
+{
+	char buf[MAX_MSG_LEN];
+	size_t end;
+	while ((end = inbuf.find('\n')) == std::string::npos){
+		if (profile.enabled){
+			latency_wait_readable(sock, profile);
+		}
+		ssize_t br = recv(sock, buf, sizeof(buf), 0);
+		if (br <= 0){
+			return false;
+		}
+		inbuf.append(buf, br);
+	}
+	inbuf.erase(0, end + 1);
+	return true;
+}
+
+/**
+ * Connect a benchmark client to the server and register its name. The server listens on the
+ * address its host name resolves to, so resolve it the same way.
+ * @return the connection, or -1 on error.
+ */
+int connect_client (int port, const std::string& name, const latency_profile& profile,
+                    std::string& inbuf)
+{
+	char host_name[MAX_HOST_NAME_LEN];
+	struct hostent* host;
+	if (gethostname(host_name, MAX_HOST_NAME_LEN) == -1 || (host = gethostbyname(host_name)) == NULL){
+		std::cout << "ERROR: gethostbyname " << errno << "." << std::endl;
+		return -1;
+	}
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = host->h_addrtype;
+	address.sin_port = htons(port);
+	memcpy(&address.sin_addr, host->h_addr, host->h_length);
+	for (int waited_ms = 0; waited_ms < RTT_CONNECT_MS; waited_ms += 10){
+		int sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (connect(sock, (struct sockaddr*) &address, sizeof(address)) == 0){
+			std::string name_msg = "name " + name + END_LINE;
+			if (!latency_tune_socket(sock, profile) ||
+			    send(sock, name_msg.c_str(), name_msg.length(), 0) < 0 || !read_line(sock, inbuf, profile)){
+				close(sock);
+				return -1;
+			}
+			return sock;
+		}
+		close(sock);
+		usleep(10000); // The server is not listening yet.
+	}
+	return -1;
+}
+
+/**
+ * Measure the round trip of a direct send - from the request until the "Sent successfully." ack -
+ * through a server started with the given profile. The receiver reads every message before the
+ * next request, so the server never has a backlog.
+ * @param profile_name the name in the results.
+ * @param port the port of the server.
+ * @param samples the number of round trips to time.
+ * @param low_latency true for the low-latency profile, on the server and on the benchmark clients.
+ */
+void run_rtt (const char* profile_name, int port, unsigned long samples, bool low_latency)
+{
+	latency_profile profile = {low_latency, DEFAULT_SPIN_US, -1};
+	std::vector<std::string> options;
+	if (low_latency){
+		options.push_back(LOW_LATENCY_OPT);
+		// Spinning on the CPU of the server would starve it - pin the two apart when we can.
+		if (sysconf(_SC_NPROCESSORS_ONLN) > 1){
+			options.push_back(CPU_OPT);
+			options.push_back("0");
+			profile.cpu = 1;
+		}
+	}
+	pid_t server = start_server(port, options);
+	std::string sender_buf, receiver_buf;
+	int sender = connect_client(port, "rttsender", profile, sender_buf);
+	int receiver = connect_client(port, "rttreceiver", profile, receiver_buf);
+	if (server < 0 || sender < 0 || receiver < 0 || !latency_apply(profile)){
+		printf("{\"error\": \"could not start the %s round trip\"}\n", profile_name);
+	}
+	else{
+		std::string request = std::string("send rttreceiver ") + MESSAGE + END_LINE;
+		std::vector<uint64_t> rtt_ns;
+		for (unsigned long i = 0; i < RTT_WARMUP + samples; i ++){
+			uint64_t start = now_ns();
+			if (send(sender, request.c_str(), request.length(), 0) < 0 ||
+			    !read_line(sender, sender_buf, profile)){
+				break;
+			}
+			uint64_t elapsed = now_ns() - start;
+			if (!read_line(receiver, receiver_buf, profile)){
+				break;
+			}
+			if (i >= RTT_WARMUP){
+				rtt_ns.push_back(elapsed);
+			}
+		}
+		std::sort(rtt_ns.begin(), rtt_ns.end());
+		if (rtt_ns.size() < samples){
+			printf("{\"error\": \"the %s server closed the connection\"}\n", profile_name);
+		}
+		else{
+			printf("{\"bench\": \"rtt\", \"profile\": \"%s\", \"samples\": %lu, \"p50_us\": %.1f, "
+			       "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}\n", profile_name, samples,
+			       rtt_ns[samples / 2] / 1e3, rtt_ns[samples * 99 / 100] / 1e3,
+			       rtt_ns[samples * 999 / 1000] / 1e3, rtt_ns[samples - 1] / 1e3);
+		}
+		fflush(stdout);
+	}
+	if (sender >= 0){
+		close(sender);
+	}
+	if (receiver >= 0){
+		close(receiver);
+	}
+	if (server > 0){
+		kill(server, SIGTERM);
+		waitpid(server, NULL, 0);
+	}
+}
+
+/**
+ * Run the benchmarks at the scales given on the command line (default 1k, 100k and 1M clients),
+ * or the round trip benchmark with --rtt.
+ */
+int main (int argc, char *argv[])
+{
+	if (argc > 1 && std::string(argv[1]).compare(RTT_OPT) == 0){
+		unsigned long samples = argc > 2 ? strtoul(argv[2], NULL, 10) : RTT_SAMPLES;
+		if (samples == 0){
+			std::cout << INVALID_ARG;
+			return 1;
+		}
+		run_rtt("default", RTT_PORT, samples, false);
+		run_rtt("low-latency", RTT_PORT + 1, samples, true);
+		return 0;
+	}
+
+	client_transport.send = bench_send;
+	client_transport.disconnect = bench_disconnect;
+	client_transport.reject = bench_reject;
+	client_transport.attach_shm = bench_attach_shm;
+	client_transport.receive_attachment = bench_receive_attachment;
+	shed_lag_ms = 0; // There is no event loop to measure.
+	shed_queue = 0;
+
+	if (argc > 1 && std::string(argv[1]).compare(CHECK_OPT) == 0){
+		std::cout.setstate(std::ios::badbit);
+		bool ok = check_history_reconnect();
+		ok = check_bounded_rss() && ok;
+		return ok ? 0 : 1;
+	}
+
+	std::vector<unsigned long> scales;
+	for (int i = 1; i < argc; i ++){
+		unsigned long clients = strtoul(argv[i], NULL, 10);
+		if (clients == 0){
+			std::cout << INVALID_ARG;
+			return 1;
+		}
+		scales.push_back(clients);
+	}
+	if (scales.empty()){
+		scales.push_back(1000);
+		scales.push_back(100000);
+		scales.push_back(1000000);
+	}
+
+	// The handlers log every request to stdout - drop that, the results are printed with printf.
+	std::cout.setstate(std::ios::badbit);
+	for (unsigned int i = 0; i < scales.size(); i ++){
+		run_scale(scales[i]);
+	}
+	return 0;
+}
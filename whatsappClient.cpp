@@ -3,14 +3,27 @@
 
 #include <iostream>
 #include <vector>
+#include <map>
 #include <regex>
 #include <set>
+#include <sstream>
+#include <iterator>
+#include <algorithm>
+#include <cstring>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include "whatsappShm.h"
+#include "whatsappLatency.h"
 
 // -------------------------------------------- Defines --------------------------------------------
 
@@ -20,28 +33,95 @@
 #define SEND "send "
 #define WHO "who"
 #define EXIT "exit"
+#define HISTORY "history "
+#define HISTORY_HEADER " messages in the history of "
+#define ATTACH "attach "
+#define ATTACH_HEADER "@attachment " // The line before the bytes of an attachment we get.
+#define ATTACH_READY "Ready for the attachment.\n"
+#define ATTACH_PREFIX "attachment_" // The received attachments are saved as attachment_<sender>_<name>.
+#define ATTACH_BUFFER 65536
+#define ATTACH_MAX_NAME_LEN 64 // Longer names are cut, the server refuses them.
 
 #define END_LINE "\n"
 #define WHO_COMMAND "who\n"
 #define EXIT_COMMAND "exit\n"
 
-#define INVALID_ARG "Usage: whatsappClient clientName serverAddress serverPort\n"
+#define INVALID_ARG "Usage: whatsappClient clientName serverAddress serverPort [latency options]\n" \
+                    "       whatsappClient --gateway serverAddress serverPort [latency options]\n" \
+                    "       (latency options: --low-latency [--spin-us num] [--cpu num])\n" \
+                    "       (serverAddress may also be unix:socketPath or shm:socketPath)\n"
 #define CON_FAIL "Failed to connect the server\n"
 #define CATCH_NAME "Client name is already in use.\n"
+#define SERVER_BUSY "Server is busy, retry after " // Followed by the retry hint in ms.
+#define MAX_CONNECT_ATTEMPTS 5
 #define CON_SUCCEED "Connected Successfully\n"
 #define INVALID_COMMAND "ERROR: Invalid input."
 
 #define CREATE_GRP_FAILED "ERROR: failed to create group \""
 #define SEND_FAILED "ERROR: failed to send."
 #define WHO_FAILED "ERROR: failed to receive list of connected clients."
+#define HISTORY_FAILED "ERROR: failed to fetch history."
+#define ATTACH_FAILED "ERROR: failed to send attachment."
+#define ERROR_PREFIX "ERROR:"
 
 #define MAX_MSG_LEN 257
 
+#define GATEWAY_OPT "--gateway"
+#define GATEWAY_CONNECT "connect"
+#define GATEWAY_MAX_EVENTS 64
+#define GATEWAY_STDIN_BUFFER 4096
+#define GATEWAY_NO_SESSION "ERROR: no such session."
+#define GATEWAY_SESSION_EXISTS "ERROR: session already exists."
+#define GATEWAY_SHM_ERR "ERROR: the gateway does not support shm."
+#define GATEWAY_DISCONNECTED "Disconnected."
+#define GATEWAY_QUEUE_MAX (1 << 20) // The bytes a session may queue for a server that does not read them.
+#define GATEWAY_QUEUE_FULL "ERROR: the session is not keeping up."
+
+#define UNIX_PREFIX "unix:"
+#define SHM_PREFIX "shm:"
+
+#define TRANSPORT_TCP 0
+#define TRANSPORT_UNIX 1
+#define TRANSPORT_SHM 2
+
 // ---------------------------------------- Global variables ---------------------------------------
 
 int sockfd;
 std::string client_name;
 
+int transport = TRANSPORT_TCP;
+shm_endpoint shm; // The shared-memory channel when transport is TRANSPORT_SHM.
+std::string server_input; // Bytes the server sent after the last line we handled.
+
+latency_profile client_latency = {false, DEFAULT_SPIN_US, -1};
+
+struct sockaddr_storage server_address;
+socklen_t server_address_len;
+
+/**
+ * A client session hosted by the gateway - its connection and the bytes the server sent that do
+ * not form a whole line yet.
+ */
+struct gateway_session {
+	int sock; // -1 while the session waits to retry a busy server.
+	bool connecting; // The non-blocking connect did not complete yet.
+	bool watching_out; // The socket is watched for EPOLLOUT.
+	bool registered; // The server answered the session name.
+	int attempt; // The connect attempts so far.
+	std::string outbuf; // Bytes the socket did not take yet.
+	std::string held; // Commands given before the server answered the session name.
+	std::string inbuf;
+	size_t attachment_left; // The bytes of an attachment that still arrive, and are skipped.
+};
+
+std::map<std::string, gateway_session> gatewaySessions; // Map session names to their sessions.
+
+std::map<int, std::string> gatewaySockets; // Map the session sockets to the session names.
+
+std::multimap<uint64_t, std::string> gatewayRetries; // Map retry times (ms) to the sessions that wait for them.
+
+int epoll_fd;
+
 // ------------------------------------------- Functions -------------------------------------------
 
 /**
@@ -91,24 +171,208 @@ std::string parse_list_of_clients (std::string list_of_client_names)
 }
 
 /**
- * This function read a message that was sent to the client by the server and print it.
- * @param msg - pointer that will contain the receive message.
+ * Send a request to the server over the current transport.
+ * @param request the request.
+ * @return the number of bytes sent, or -1 on error (like send()).
  */
-void client_recv_server_msg (char* msg)
+ssize_t client_write (const std::string& request)
 {
-	unsigned int b_count = 0; // counts bytes read
-	ssize_t br = 0  ; // bytes read this pass
+	if (transport == TRANSPORT_SHM){
+		return shm_send(shm, request.c_str(), request.length());
+	}
+	return send(sockfd, request.c_str(), request.length(), 0);
+}
 
-	char * msg_p = msg;
-	char end = '\0';
-	while (end != '\n') {
-		br = (int) recv (sockfd, msg_p, MAX_MSG_LEN - b_count, 0);
-		if (br > 0) {
-			b_count += br;
-			msg_p += br;
+/**
+ * Read what the server sent over the current transport, block until something arrives.
+ * @param buf the buffer to read into.
+ * @param max the buffer size.
+ * @return the number of bytes read, 0 if the server closed the connection, -1 on error (like recv()).
+ */
+ssize_t client_read (char* buf, size_t max)
+{
+	if (transport != TRANSPORT_SHM){
+		if (client_latency.enabled){
+			latency_wait_readable(sockfd, client_latency);
 		}
+		return recv(sockfd, buf, max, 0);
+	}
+	uint64_t spin_end = latency_now_ns() + (uint64_t) client_latency.spin_us * 1000;
+	while (true){
+		size_t br = shm_ring_read(shm.in, buf, max);
+		if (br > 0){
+			return br;
+		}
+		if (client_latency.enabled && latency_now_ns() < spin_end){
+			continue; // Spin on the ring before we sleep on the doorbell.
+		}
+		// Wait for the doorbell, the socket is readable only when the server closed it.
+		struct pollfd pfds[2];
+		pfds[0].fd = shm.in_fd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = sockfd;
+		pfds[1].events = POLLIN;
+		if (poll(pfds, 2, -1) < 0){
+			return -1;
+		}
+		if (pfds[0].revents){
+			shm_clear_doorbell(shm.in_fd);
+			continue; // Read the ring before we look at the socket - the server may write and close.
+		}
+		if (pfds[1].revents){
+			return recv(sockfd, buf, max, 0);
+		}
+	}
+}
+
+/**
+ * Resolve the server address - host name, unix:path or shm:path - and set the transport.
+ * @param address the server address.
+ * @param port the server port (ignored for the local transports).
+ * @return true on success.
+ */
+bool resolve_server_address (std::string address, char* port)
+{
+	memset(&server_address, 0, sizeof(server_address));
+
+	if (address.compare(0, strlen(UNIX_PREFIX), UNIX_PREFIX) == 0 ||
+	    address.compare(0, strlen(SHM_PREFIX), SHM_PREFIX) == 0){
+		transport = address[0] == 'u' ? TRANSPORT_UNIX : TRANSPORT_SHM;
+		std::string path = address.substr(address.find(":") + 1);
+		struct sockaddr_un* unix_address = (struct sockaddr_un*) &server_address;
+		unix_address->sun_family = AF_UNIX;
+		strncpy(unix_address->sun_path, path.c_str(), sizeof(unix_address->sun_path) - 1);
+		server_address_len = sizeof(struct sockaddr_un);
+	}
+	else{
+		struct hostent* host;
+		if ((host = gethostbyname(address.c_str())) == NULL){
+			std::cout << "ERROR: gethostbyname " << errno << "." << std::endl;
+			return false;
+		}
+		// server_address initialization.
+		struct sockaddr_in* inet_address = (struct sockaddr_in*) &server_address;
+		inet_address->sin_family = host->h_addrtype;
+		memcpy(&inet_address->sin_addr, host->h_addr, host->h_length);
+		inet_address->sin_port = htons(atoi(port));
+		server_address_len = sizeof(struct sockaddr_in);
+	}
+	return true;
+}
+
+/**
+ * Open a new connection to the resolved server address.
+ * @param nonblocking open a non-blocking socket, whose connect may still be in progress when it
+ *                    is returned (it is writable once the connect completes).
+ * @return the connected socket, or -1 on error.
+ */
+int open_server_socket (bool nonblocking = false)
+{
+	int sock;
+	// Create the client socket.
+	if ((sock = socket(server_address.ss_family, SOCK_STREAM | (nonblocking ? SOCK_NONBLOCK : 0), 0)) < 0) {
+		std::cout << "ERROR: socket " << errno << "." << std::endl;
+		return -1;
+	}
+	// Connect to server.
+	if (connect(sock, (struct sockaddr *)&server_address, server_address_len) < 0 &&
+	    !(nonblocking && errno == EINPROGRESS)) {
+		std::cout << "ERROR: connect " << errno << "." << std::endl;
+		close(sock);
+		return -1;
+	}
+	if (server_address.ss_family != AF_UNIX && !latency_tune_socket(sock, client_latency)){
+		std::cout << "ERROR: setsockopt " << errno << "." << std::endl;
+	}
+	return sock;
+}
+
+/**
+ * Connect to the server over the given address - host name, unix:path or shm:path.
+ * @param address the server address.
+ * @param port the server port (ignored for the local transports).
+ */
+void connect_to_server (std::string address, char* port)
+{
+	if (!resolve_server_address(address, port)){
+		exit(1);
+	}
+	if ((sockfd = open_server_socket()) < 0){
+		std::cout << CON_FAIL << std::endl;
+		exit(1);
+	}
+	if (transport == TRANSPORT_SHM && !shm_attach(sockfd, shm)){
+		if (errno == ECONNREFUSED){ // No channel for us - go on over the unix domain socket.
+			std::cout << "ERROR: the server refused shm, using the unix socket." << std::endl;
+			transport = TRANSPORT_UNIX;
+			return;
+		}
+		std::cout << "ERROR: shm attach " << errno << "." << std::endl;
+		std::cout << CON_FAIL << std::endl;
+		close(sockfd);
+		exit(1);
+	}
+}
+
+/**
+ * Save an attachment the server sends - the ATTACH_HEADER line and then its bytes - to
+ * attachment_<sender>_<name> in the working directory.
+ * @param input what was read so far, starting with the whole header line. The header and the
+ *              bytes of the attachment are taken from it, whatever came after them is left.
+ */
+void client_recv_attachment (std::string& input)
+{
+	size_t header_end = input.find('\n');
+	std::istringstream fields(input.substr(strlen(ATTACH_HEADER), header_end - strlen(ATTACH_HEADER)));
+	std::string sender, name;
+	size_t size = 0;
+	fields >> sender >> name >> size;
+	std::string path = ATTACH_PREFIX + sender + "_" + name;
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0){
+		std::cout << "ERROR: open " << errno << "." << std::endl;
+	}
+
+	// The first bytes were read with the header, the rest is read straight to the file.
+	size_t buffered = std::min(size, input.length() - header_end - 1);
+	bool saved = fd >= 0 && write(fd, input.data() + header_end + 1, buffered) == (ssize_t) buffered;
+	input.erase(0, header_end + 1 + buffered);
+	std::vector<char> buf(ATTACH_BUFFER);
+	for (size_t received = buffered; received < size; ){
+		ssize_t br = client_read(&buf[0], std::min(buf.size(), size - received));
+		if (br <= 0){ // Server terminated.
+			std::cout << "ERROR: recv " << errno << "." << std::endl;
+			close(sockfd);
+			exit(1);
+		}
+		saved = saved && write(fd, &buf[0], br) == br;
+		received += br;
+	}
+	if (fd >= 0){
+		close(fd);
+	}
+	if (saved){
+		std::cout << sender << ": attachment " << name << " (" << size << " bytes) saved to "
+		          << path << "." << std::endl;
+	}
+	else{
+		std::cout << "ERROR: failed to save attachment " << name << " from " << sender << "." << std::endl;
+	}
+}
+
+/**
+ * This function read a message that was sent to the client by the server and print it. It reads
+ * until there is a whole line, then handles every whole line it got - one may be the header of an
+ * attachment, which takes the bytes after it. A partial line is kept for the next call.
+ * @param msg - pointer that will contain the first line received (cut to MAX_MSG_LEN - 1 bytes).
+ */
+void client_recv_server_msg (char* msg)
+{
+	while (server_input.find('\n') == std::string::npos) {
+		char buf [MAX_MSG_LEN];
+		ssize_t br = client_read (buf, sizeof(buf));
 		if (br == 0){ // Server terminated.
-			std::cout << msg;
+			std::cout << server_input;
 			close(sockfd);
 			exit(1);
 		}
@@ -117,46 +381,114 @@ void client_recv_server_msg (char* msg)
 			close(sockfd);
 			exit(1);
 		}
-		end = msg[b_count - 1];
+		server_input.append(buf, br);
 	}
 
-	std::string str_msg(msg);
+	bool first = true;
+	size_t end;
+	while ((end = server_input.find('\n')) != std::string::npos) {
+		std::string line = server_input.substr(0, end + 1);
+		if (first){
+			msg[line.copy(msg, MAX_MSG_LEN - 1)] = '\0';
+			first = false;
+		}
+		if (line.compare(0, strlen(ATTACH_HEADER), ATTACH_HEADER) == 0){ // Its bytes are not lines.
+			client_recv_attachment(server_input);
+			continue;
+		}
+		server_input.erase(0, end + 1);
 
-	// When the server shutdown using EXIT command from the user - no need to print the exit message
-	if (str_msg.compare(EXIT_COMMAND) == 0){
-		close(sockfd);
-		exit(1);
-	}
-	else{
-		std::cout << msg;
+		// When the server shutdown using EXIT command from the user - no need to print the exit message
+		if (line.compare(EXIT_COMMAND) == 0){
+			close(sockfd);
+			exit(1);
+		}
+		std::cout << line;
 	}
 }
 
 /**
- * create_group operation, in a case the user want to create some group.
- * @param command the user command.
+ * Check a create_group command.
+ * @param command the user command (after the word "create_group").
+ * @param name the name of the client that creates the group.
+ * @return the error to print, or an empty string if the command is valid.
  */
-void client_create_group (std::string command)
+std::string check_create_group (std::string command, std::string name)
 {
 	std::string grp_name = command.substr(0, command.find(" "));
+	std::string error = CREATE_GRP_FAILED + grp_name + "\".";
 	// The command structure is invalid (include the validity check about the grp_name).
 //	std::regex regex("\\w+\\s(\\w+\\,)*\\w+");
 	std::regex regex("(([A-Z])|([a-z])|([0-9]))+\\s((([A-Z])|([a-z])|([0-9]))+\\,)*(([A-Z])|([a-z])|([0-9]))+");
 	std::smatch match;
 	if (!std::regex_match(command, match, regex)){ // Check that the command is valid
-		std::cout << CREATE_GRP_FAILED << grp_name << "\"." << std::endl;
-		return;
+		return error;
 	}
 
 	// list_of_client_names is empty. i.e empty group. (The command structure is invalid)
 	if(parse_list_of_clients(command.substr(command.find(" ") + 1)).compare("") == 0){
-		std::cout << CREATE_GRP_FAILED << grp_name << "\"." << std::endl;
-		return;
+		return error;
 	}
 
 	// The group name is equal to the client name.
-	if (grp_name.compare(client_name) == 0){
-		std::cout << CREATE_GRP_FAILED << grp_name << "\"." << std::endl;
+	if (grp_name.compare(name) == 0){
+		return error;
+	}
+	return "";
+}
+
+/**
+ * Check a send command.
+ * @param command the user command (after the word "send").
+ * @param name the name of the sending client.
+ * @return the error to print, or an empty string if the command is valid.
+ */
+std::string check_send (std::string command, std::string name)
+{
+	std::string receiver = command.substr(0, command.find(" "));
+
+//	std::regex regex("\\w+(,\\w+)*\\s(.)*");
+	std::regex regex("(([A-Z])|([a-z])|([0-9]))+(,(([A-Z])|([a-z])|([0-9]))+)*\\s(.)*");
+	std::smatch match;
+	if (!std::regex_match(command, match, regex)){ // Invalid command structure.
+		return SEND_FAILED;
+	}
+
+	// The client try to send a message to himself.
+	std::stringstream receivers(receiver);
+	std::string token;
+	while (getline(receivers, token, ',')){
+		if (token.compare(name) == 0){
+			return SEND_FAILED;
+		}
+	}
+	return "";
+}
+
+/**
+ * Check a history command.
+ * @param command the user command (after the word "history").
+ * @return the error to print, or an empty string if the command is valid.
+ */
+std::string check_history (std::string command)
+{
+	std::regex regex("(([A-Z])|([a-z])|([0-9]))+(\\s[0-9]+)?");
+	std::smatch match;
+	if (!std::regex_match(command, match, regex)){ // Invalid command structure.
+		return HISTORY_FAILED;
+	}
+	return "";
+}
+
+/**
+ * create_group operation, in a case the user want to create some group.
+ * @param command the user command.
+ */
+void client_create_group (std::string command)
+{
+	std::string error = check_create_group(command, client_name);
+	if (!error.empty()){
+		std::cout << error << std::endl;
 		return;
 	}
 
@@ -164,7 +496,7 @@ void client_create_group (std::string command)
 	std::string request = CREATE_GROUP + command + END_LINE;
 
 	// We can send the request to the server.
-	if (send(sockfd, request.c_str(), request.length(), 0) < 0) {
+	if (client_write(request) < 0) {
 		std::cout << "ERROR: send " << errno << "." << std::endl;
 		close(sockfd);
 		exit(1);
@@ -177,31 +509,22 @@ void client_create_group (std::string command)
 }
 
 /**
- * send operation, in a case the user want to send a message to someone.
+ * send operation, in a case the user want to send a message to someone, or to a comma separated
+ * list of receivers at once.
  * @param command the user command.
  */
 void client_send (std::string command)
 {
-	std::string receiver = command.substr(0, command.find(" "));
-
-//	std::regex regex("\\w+\\s(.)*");
-	std::regex regex("(([A-Z])|([a-z])|([0-9]))+\\s(.)*");
-	std::smatch match;
-	if (!std::regex_match(command, match, regex)){ // Invalid command structure.
-		std::cout << SEND_FAILED << std::endl;
-		return;
-	}
-
-	// The client try to send a message to himself.
-	if (receiver.compare(client_name) == 0){
-		std::cout << SEND_FAILED << std::endl;
+	std::string error = check_send(command, client_name);
+	if (!error.empty()){
+		std::cout << error << std::endl;
 		return;
 	}
 
 	// Create the request to the server.
 	std::string request = SEND + command + END_LINE;
 
-	if (send(sockfd, request.c_str(), request.length(), 0) < 0) {
+	if (client_write(request) < 0) {
 		std::cout << "ERROR: send " << errno << "." << std::endl;
 		close(sockfd);
 		exit(1);
@@ -227,7 +550,7 @@ void client_who (std::string command)
 
 	// Create the request to the server.
 	std::string request = WHO_COMMAND;
-	if (send(sockfd, request.c_str(), request.length(), 0) < 0) {
+	if (client_write(request) < 0) {
 		std::cout << "ERROR: send " << errno << "." << std::endl;
 		std::cout << WHO_FAILED << std::endl;
 		close(sockfd);
@@ -240,6 +563,69 @@ void client_who (std::string command)
 	client_recv_server_msg(msg);
 }
 
+/**
+ * Read and print the response to a history request - a header line with the number of messages
+ * and a line for each message. Unlike the other responses it may be longer than MAX_MSG_LEN.
+ */
+void client_recv_history ()
+{
+	std::string response;
+	long lines_left = -1; // Unknown until the header arrives.
+	char buf [MAX_MSG_LEN];
+	while (lines_left != 0){
+		ssize_t br = client_read(buf, sizeof(buf));
+		if (br <= 0){ // Server terminated.
+			if (br < 0){
+				std::cout << "ERROR: recv " << errno << "." << std::endl;
+			}
+			close(sockfd);
+			exit(1);
+		}
+		response.append(buf, br);
+
+		size_t end;
+		while (lines_left != 0 && (end = response.find(END_LINE)) != std::string::npos){
+			std::string line = response.substr(0, end + 1);
+			response.erase(0, end + 1);
+			std::cout << line;
+			if (lines_left > 0){
+				lines_left--;
+			}
+			else if (line.compare(0, strlen(ERROR_PREFIX), ERROR_PREFIX) == 0){
+				lines_left = 0;
+			}
+			else if (line.find(HISTORY_HEADER) != std::string::npos){
+				lines_left = strtol(line.c_str(), NULL, 10);
+			}
+		}
+	}
+	std::cout << response; // A message that was pushed right after the history.
+}
+
+/**
+ * history operation, in a case the user want to see the recent messages of a conversation.
+ * @param command the client or group name, and optionally the last sequence number already seen.
+ */
+void client_history (std::string command)
+{
+	std::string error = check_history(command);
+	if (!error.empty()){
+		std::cout << error << std::endl;
+		return;
+	}
+
+	// Create the request to the server.
+	std::string request = HISTORY + command + END_LINE;
+	if (client_write(request) < 0) {
+		std::cout << "ERROR: send " << errno << "." << std::endl;
+		close(sockfd);
+		exit(1);
+	}
+
+	// Receive the server response.
+	client_recv_history();
+}
+
 /**
  * exit operation, in a case the user want to disconnect from the server.
  * @param command - reminder from user input after the word "exit"
@@ -254,7 +640,7 @@ void client_exit (std::string command)
 
 	// Create the request to the server.
 	std::string request = EXIT_COMMAND;
-	if (send(sockfd, request.c_str(), request.length(), 0) < 0) {
+	if (client_write(request) < 0) {
 		std::cout << "ERROR: send " << errno << "." << std::endl;
 		close(sockfd);
 		exit(1);
@@ -269,6 +655,73 @@ void client_exit (std::string command)
 	exit(0);
 }
 
+/**
+ * attach operation, in a case the user want to send a file to a client or a group. The server
+ * answers the request with ATTACH_READY, then gets the file bytes straight from the file with
+ * sendfile, and answers again once it has them all.
+ * @param command the user command - the receiver and the file path.
+ */
+void client_attach (std::string command)
+{
+	std::string receiver = command.substr(0, command.find(" "));
+	std::string path = command.find(" ") == std::string::npos ? "" : command.substr(command.find(" ") + 1);
+	if (!check_name_legality(receiver) || receiver.compare(client_name) == 0 || path.empty()){
+		std::cout << ATTACH_FAILED << std::endl;
+		return;
+	}
+	if (transport == TRANSPORT_SHM){
+		std::cout << "ERROR: attachments are not supported over shm." << std::endl;
+		return;
+	}
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat file_stat;
+	if (fd < 0 || fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode) || file_stat.st_size == 0){
+		std::cout << ATTACH_FAILED << std::endl;
+		if (fd >= 0){
+			close(fd);
+		}
+		return;
+	}
+
+	// The receivers save it under its base name, with only the characters the server allows.
+	std::string name = path.substr(path.find_last_of('/') + 1);
+	for (size_t i = 0; i < name.length(); i ++){
+		if (!isalnum((unsigned char) name[i]) && name[i] != '.' && name[i] != '-'){
+			name[i] = '_';
+		}
+	}
+	if (name[0] == '.'){
+		name[0] = '_';
+	}
+	std::ostringstream request;
+	request << ATTACH << receiver << " " << file_stat.st_size << " " << name.substr(0, ATTACH_MAX_NAME_LEN) << END_LINE;
+	if (client_write(request.str()) < 0) {
+		std::cout << "ERROR: send " << errno << "." << std::endl;
+		close(sockfd);
+		exit(1);
+	}
+
+	char msg [MAX_MSG_LEN];
+	memset(msg, 0, sizeof(msg));
+	client_recv_server_msg(msg);
+	if (strcmp(msg, ATTACH_READY) != 0){
+		close(fd);
+		return;
+	}
+	off_t offset = 0;
+	while (offset < file_stat.st_size){
+		if (sendfile(sockfd, fd, &offset, file_stat.st_size - offset) <= 0){
+			std::cout << "ERROR: sendfile " << errno << "." << std::endl;
+			close(sockfd);
+			exit(1);
+		}
+	}
+	close(fd);
+
+	memset(msg, 0, sizeof(msg));
+	client_recv_server_msg(msg);
+}
+
 /**
  * This function receive a command (from the user) and send it to the treatment of cooresponding
  * funtion.
@@ -292,6 +745,12 @@ void sent_command_to_function (std::string command)
 	else if (operation.compare("exit") == 0) {
 		client_exit(command.substr(4));
 	}
+	else if (operation.compare("history") == 0) {
+		client_history(command.substr(command.find(" ") + 1));
+	}
+	else if (operation.compare("attach") == 0) {
+		client_attach(command.substr(command.find(" ") + 1));
+	}
 	else {
 		std::cout << INVALID_COMMAND << std::endl;
 	}
@@ -304,7 +763,7 @@ void sent_command_to_function (std::string command)
 void send_name_to_server(std::string name){
 	int bytes;
 	std::string name_msg = "name " + name + END_LINE;
-	if ((bytes = send(sockfd, name_msg.c_str(), name_msg.length(), 0)) < 0) {
+	if ((bytes = client_write(name_msg)) < 0) {
 		std::cout << "ERROR: send " << errno << "." << std::endl;
 		close(sockfd);
 		exit(1);
@@ -324,13 +783,26 @@ void client_listen ()
 	FD_ZERO(&read_fds);
 	FD_SET(sockfd, &all_fds);
 	FD_SET(STDIN_FILENO, &all_fds);
+	int fd_max = sockfd;
+	if (transport == TRANSPORT_SHM){ // The server rings the doorbell when it wrote to the ring.
+		FD_SET(shm.in_fd, &all_fds);
+		fd_max = std::max(fd_max, shm.in_fd);
+	}
 
 	int ret_val;
 	while (true)
 	{
+		// Messages that are already in the ring don't ring the doorbell again.
+		if (transport == TRANSPORT_SHM && !shm_ring_empty(shm.in)){
+			char msg [MAX_MSG_LEN];
+			memset(msg, 0, sizeof(msg));
+			client_recv_server_msg(msg);
+			continue;
+		}
+
 		read_fds = all_fds;
 
-		ret_val = select(sockfd + 1, &read_fds, NULL, NULL, NULL);
+		ret_val = latency_select(fd_max + 1, &read_fds, NULL, NULL, client_latency);
 
 		if (ret_val < 0) // System call error
 		{
@@ -339,6 +811,10 @@ void client_listen ()
 			exit(1);
 		}
 
+		if (transport == TRANSPORT_SHM && FD_ISSET(shm.in_fd, &read_fds)){
+			shm_clear_doorbell(shm.in_fd); // The ring is read on the next iteration.
+		}
+
 		if (FD_ISSET(sockfd, &read_fds)) { // The server wrote something to me
 			char msg [MAX_MSG_LEN];
 			memset(msg, 0, sizeof(msg));
@@ -354,58 +830,493 @@ void client_listen ()
 
 
 /**
- * The main function responsible to run the whole flow of the client side.
- * @param argc the number of arguments.
- * @param argv the arguments of the program (client name, address to connect to, port number).
- * @return
+ * Print a line on behalf of a gateway session.
+ * @param name the session name.
+ * @param line the line (without the end of line).
  */
-int main (int argc, char *argv[])
+void gateway_print (const std::string& name, const std::string& line)
 {
-	// Validity check
-	if (argc != VALID_ARG_NUM) {
-		std::cout << INVALID_ARG;
-		return 0;
+	std::cout << name << " " << line << std::endl;
+}
+
+/**
+ * The time to wait before we come back to a busy server - its hint, plus a random part so the
+ * clients it turned away don't all return together.
+ * @param msg the SERVER_BUSY line.
+ * @return the time to wait in ms.
+ */
+long busy_retry_delay_ms (const char* msg)
+{
+	long retry_after_ms = strtol(msg + strlen(SERVER_BUSY), NULL, 10);
+	return retry_after_ms + rand() % (retry_after_ms / 2 + 1);
+}
+
+/**
+ * The monotonic clock in ms, for the retry times of the gateway sessions.
+ */
+uint64_t gateway_now_ms ()
+{
+	return latency_now_ns() / 1000000;
+}
+
+/**
+ * Watch a session socket for EPOLLOUT too, or stop watching it - only while it has bytes to send.
+ * @param session the session.
+ * @param out true to watch for EPOLLOUT.
+ */
+void gateway_watch_out (gateway_session& session, bool out)
+{
+	if (session.watching_out == out){
+		return;
+	}
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = out ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	event.data.fd = session.sock;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session.sock, &event) < 0){
+		std::cout << "ERROR: epoll_ctl " << errno << "." << std::endl;
 	}
+	session.watching_out = out;
+}
 
-	struct sockaddr_in server_address;
-	struct hostent* host;
+/**
+ * Start the connect of a gateway session, and queue its name. The connect completes, and the name
+ * is sent, once epoll reports the socket writable.
+ * @param name the session name.
+ * @param session the session.
+ * @return false if there is no socket.
+ */
+bool gateway_open (const std::string& name, gateway_session& session)
+{
+	if ((session.sock = open_server_socket(true)) < 0){
+		return false;
+	}
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLOUT;
+	event.data.fd = session.sock;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, session.sock, &event) < 0){
+		std::cout << "ERROR: epoll_ctl " << errno << "." << std::endl;
+		close(session.sock);
+		session.sock = -1;
+		return false;
+	}
+	session.connecting = true;
+	session.watching_out = true;
+	session.registered = false;
+	session.attempt ++;
+	session.outbuf = "name " + name + END_LINE;
+	session.inbuf.clear();
+	session.attachment_left = 0;
+	gatewaySockets[session.sock] = name;
+	return true;
+}
 
-	memset(&server_address, 0, sizeof(server_address));
+/**
+ * Open a new gateway session: connect to the server and register the session name.
+ * @param name the session (and client) name.
+ */
+void gateway_connect (const std::string& name)
+{
+	if (gatewaySessions.count(name)){
+		gateway_print(name, GATEWAY_SESSION_EXISTS);
+		return;
+	}
+	if (!check_name_legality(name)){
+		gateway_print(name, INVALID_COMMAND);
+		return;
+	}
+	gateway_session session;
+	session.attempt = 0;
+	if (!gateway_open(name, session)){
+		gateway_print(name, CON_FAIL);
+		return;
+	}
+	gatewaySessions[name] = session;
+}
 
-	if ((host = gethostbyname(argv[2])) == NULL){
-		std::cout << "ERROR: gethostbyname " << errno << "." << std::endl;
+/**
+ * Close a gateway session (the server already closed it, or the gateway is shutting down).
+ * @param sock the session socket.
+ * @param reason the line to print for the session.
+ */
+void gateway_close (int sock, const std::string& reason = GATEWAY_DISCONNECTED)
+{
+	std::map<int, std::string>::iterator it = gatewaySockets.find(sock);
+	if (it == gatewaySockets.end()){
+		return;
 	}
+	gateway_print(it->second, reason);
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+	close(sock);
+	gatewaySessions.erase(it->second);
+	gatewaySockets.erase(it);
+}
 
-	// server_address initialization.
-	server_address.sin_family = host->h_addrtype;
-	memcpy(&server_address.sin_addr, host->h_addr, host->h_length);
-	server_address.sin_port = htons(atoi(argv[3]));
+/**
+ * Send what a session queued, as much as its socket takes now - the rest is sent when epoll
+ * reports the socket writable, so a slow session never holds up the others.
+ * @param session the session.
+ * @return false if the session was closed.
+ */
+bool gateway_flush (gateway_session& session)
+{
+	if (session.connecting){
+		return true;
+	}
+	while (!session.outbuf.empty()){
+		ssize_t bs = send(session.sock, session.outbuf.data(), session.outbuf.length(),
+		                  MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (bs < 0 && errno == EINTR){
+			continue;
+		}
+		if (bs < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			break;
+		}
+		if (bs < 0){
+			std::cout << "ERROR: send " << errno << "." << std::endl;
+			gateway_close(session.sock);
+			return false;
+		}
+		session.outbuf.erase(0, bs);
+	}
+	gateway_watch_out(session, !session.outbuf.empty());
+	return true;
+}
 
-	// Create the client socket.
-	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		std::cout << "ERROR: socket " << errno << "." << std::endl;
+/**
+ * A session socket is writable - complete its connect, and send what it queued.
+ * @param sock the session socket.
+ */
+void gateway_send (int sock)
+{
+	std::map<int, std::string>::iterator it = gatewaySockets.find(sock);
+	if (it == gatewaySockets.end()){
+		return;
+	}
+	gateway_session& session = gatewaySessions[it->second];
+	if (session.connecting){
+		int error = 0;
+		socklen_t len = sizeof(error);
+		if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0){
+			std::cout << "ERROR: connect " << (error != 0 ? error : errno) << "." << std::endl;
+			gateway_close(sock, CON_FAIL);
+			return;
+		}
+		session.connecting = false;
+		if (server_address.ss_family != AF_UNIX && !latency_tune_socket(sock, client_latency)){
+			std::cout << "ERROR: setsockopt " << errno << "." << std::endl;
+		}
+	}
+	gateway_flush(session);
+}
+
+/**
+ * The server was busy - close the session socket and connect again after the time it asked for.
+ * The session keeps the commands it was given meanwhile.
+ * @param sock the session socket.
+ * @param line the SERVER_BUSY line.
+ */
+void gateway_retry (int sock, const std::string& line)
+{
+	std::map<int, std::string>::iterator it = gatewaySockets.find(sock);
+	gateway_session& session = gatewaySessions[it->second];
+	gatewayRetries.insert(std::make_pair(gateway_now_ms() + busy_retry_delay_ms(line.c_str()), it->second));
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+	close(sock);
+	session.sock = -1;
+	session.outbuf.clear();
+	gatewaySockets.erase(it);
+}
+
+/**
+ * Connect again the sessions whose retry time came.
+ * @return the time until the next retry in ms, or -1 if there is none.
+ */
+int gateway_retry_due ()
+{
+	uint64_t now = gateway_now_ms();
+	while (!gatewayRetries.empty() && gatewayRetries.begin()->first <= now){
+		std::string name = gatewayRetries.begin()->second;
+		gatewayRetries.erase(gatewayRetries.begin());
+		std::map<std::string, gateway_session>::iterator it = gatewaySessions.find(name);
+		if (it != gatewaySessions.end() && !gateway_open(name, it->second)){
+			gateway_print(name, CON_FAIL);
+			gatewaySessions.erase(it);
+		}
+	}
+	return gatewayRetries.empty() ? -1 : (int) (gatewayRetries.begin()->first - now);
+}
+
+/**
+ * Handle a control line - "<session> connect" or "<session> <command>", where the command is any
+ * command of the interactive client. The command is checked like the interactive client does, and
+ * queued without waiting for the response - the responses arrive like any other server line.
+ * Commands given before the server answered the session name are held until it does.
+ * @param line the control line.
+ */
+void gateway_command (std::string line)
+{
+	std::string name = line.substr(0, line.find(" "));
+	std::string command = line.find(" ") == std::string::npos ? "" : line.substr(line.find(" ") + 1);
+	std::string operation = command.substr(0, command.find(" "));
+	std::string arguments = command.find(" ") == std::string::npos ? "" :
+	                        command.substr(command.find(" ") + 1);
+
+	if (operation.compare(GATEWAY_CONNECT) == 0){
+		gateway_connect(name);
+		return;
+	}
+	std::map<std::string, gateway_session>::iterator it = gatewaySessions.find(name);
+	if (it == gatewaySessions.end()){
+		gateway_print(name, GATEWAY_NO_SESSION);
+		return;
+	}
+
+	std::string error = INVALID_COMMAND;
+	if (operation.compare("create_group") == 0) {
+		error = check_create_group(arguments, name);
+	}
+	else if (operation.compare("send") == 0) {
+		error = check_send(arguments, name);
+	}
+	else if (operation.compare("who") == 0) {
+		error = command.compare(WHO) == 0 ? "" : WHO_FAILED;
+	}
+	else if (operation.compare("exit") == 0) {
+		error = command.compare(EXIT) == 0 ? "" : INVALID_COMMAND;
+	}
+	else if (operation.compare("history") == 0) {
+		error = check_history(arguments);
+	}
+	gateway_session& session = it->second;
+	if (error.empty() && session.held.length() + session.outbuf.length() + command.length() >= GATEWAY_QUEUE_MAX){
+		error = GATEWAY_QUEUE_FULL;
+	}
+	if (!error.empty()){
+		gateway_print(name, error);
+		return;
+	}
+
+	if (!session.registered){
+		session.held += command + END_LINE;
+		return;
+	}
+	session.outbuf += command + END_LINE;
+	gateway_flush(session);
+}
+
+/**
+ * Read what the server sent to a gateway session and print every whole line, prefixed with the
+ * session name. The gateway does not save attachments - it prints their header line and skips
+ * their bytes. The first line answers the session name - a busy server is tried again later, like
+ * the interactive client does, and otherwise the held commands are sent.
+ * @param sock the session socket.
+ */
+void gateway_recv (int sock)
+{
+	std::map<int, std::string>::iterator it = gatewaySockets.find(sock);
+	if (it == gatewaySockets.end()){
+		return;
+	}
+	gateway_session& session = gatewaySessions[it->second];
+
+	char buf [MAX_MSG_LEN];
+	ssize_t br = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+	if (br < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+		return;
+	}
+	if (br <= 0){ // The server closed the session (exit, a used name, or a server shutdown).
+		gateway_close(sock);
+		return;
+	}
+	session.inbuf.append(buf, br);
+
+	size_t end;
+	bool answered = false; // The server answered the session name now.
+	while (true){
+		if (session.attachment_left > 0){
+			size_t skipped = std::min(session.attachment_left, session.inbuf.length());
+			session.inbuf.erase(0, skipped);
+			session.attachment_left -= skipped;
+			if (session.attachment_left > 0){
+				break;
+			}
+		}
+		if ((end = session.inbuf.find(END_LINE)) == std::string::npos){
+			break;
+		}
+		std::string line = session.inbuf.substr(0, end);
+		session.inbuf.erase(0, end + 1);
+		gateway_print(it->second, line);
+		if (!session.registered){
+			if (line.compare(0, strlen(SERVER_BUSY), SERVER_BUSY) == 0 && session.attempt < MAX_CONNECT_ATTEMPTS){
+				gateway_retry(sock, line);
+				return;
+			}
+			session.registered = true;
+			answered = true;
+		}
+		if (line.compare(0, strlen(ATTACH_HEADER), ATTACH_HEADER) == 0){
+			session.attachment_left = strtoull(line.substr(line.find_last_of(' ') + 1).c_str(), NULL, 10);
+		}
+	}
+	if (answered && !session.held.empty()){
+		session.outbuf += session.held;
+		session.held.clear();
+		gateway_flush(session);
+	}
+}
+
+/**
+ * Check if every gateway session sent all it was given.
+ */
+bool gateway_drained ()
+{
+	if (!gatewayRetries.empty()){
+		return false;
+	}
+	for (std::map<std::string, gateway_session>::iterator it = gatewaySessions.begin(); it != gatewaySessions.end(); ++it){
+		if (!it->second.held.empty() || !it->second.outbuf.empty()){
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * The gateway mode - one process hosts many client sessions. Control lines are read from stdin
+ * and every line the server sends to a session is printed to stdout, prefixed with its name.
+ * When stdin ends, the gateway sends what its sessions still queue, then closes them.
+ * @param address the server address.
+ * @param port the server port.
+ */
+void gateway_listen (std::string address, char* port)
+{
+	if (!resolve_server_address(address, port)){
 		exit(1);
 	}
-	// Connect to server.
-	int con;
-	if ((con = connect(sockfd, (struct sockaddr *)&server_address, sizeof(server_address))) < 0) {
-		std::cout << "ERROR: connect " << errno << "." << std::endl;
-		std::cout << CON_FAIL << std::endl;
-		close(sockfd);
+	if (transport == TRANSPORT_SHM){
+		std::cout << GATEWAY_SHM_ERR << std::endl;
 		exit(1);
 	}
+	srand(getpid());
 
-	send_name_to_server(argv[1]);
-	client_name = argv[1];
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+		std::cout << "ERROR: epoll_create1 " << errno << "." << std::endl;
+		exit(1);
+	}
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = STDIN_FILENO;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) < 0){
+		std::cout << "ERROR: epoll_ctl " << errno << "." << std::endl;
+		exit(1);
+	}
+
+	struct epoll_event events[GATEWAY_MAX_EVENTS];
+	std::string control; // Control bytes that do not form a whole line yet.
+	bool draining = false; // stdin ended - exit once the sessions sent what they queue.
+	int timeout = -1;
+	while (true)
+	{
+		if (draining && gateway_drained()){
+			while (!gatewaySockets.empty()){
+				gateway_close(gatewaySockets.begin()->first);
+			}
+			exit(0);
+		}
+		int ready = epoll_wait(epoll_fd, events, GATEWAY_MAX_EVENTS, timeout);
+		if (ready < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			std::cout << "ERROR: epoll_wait " << errno << "." << std::endl;
+			exit(1);
+		}
+		for (int i = 0; i < ready; i ++){
+			if (events[i].data.fd != STDIN_FILENO){
+				// A failed connect reports EPOLLERR - gateway_send reads the error.
+				if (events[i].events & (EPOLLOUT | EPOLLERR)){
+					gateway_send(events[i].data.fd);
+				}
+				if (events[i].events & (EPOLLIN | EPOLLHUP)){
+					gateway_recv(events[i].data.fd);
+				}
+				continue;
+			}
+			// Read stdin directly - a controller writes many lines at once, and lines that are
+			// left in the std::cin buffer would not wake epoll up again.
+			char buf [GATEWAY_STDIN_BUFFER];
+			ssize_t br = read(STDIN_FILENO, buf, sizeof(buf));
+			if (br <= 0){ // The controller is gone.
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+				draining = true;
+				continue;
+			}
+			control.append(buf, br);
+			size_t end;
+			while ((end = control.find(END_LINE)) != std::string::npos){
+				gateway_command(control.substr(0, end));
+				control.erase(0, end + 1);
+			}
+		}
+		timeout = gateway_retry_due();
+	}
+}
+/**
+ * The main function responsible to run the whole flow of the client side.
+ * @param argc the number of arguments.
+ * @param argv the arguments of the program (client name, address to connect to, port number).
+ * @return
+ */
+int main (int argc, char *argv[])
+{
+	// Validity check
+	if (argc < VALID_ARG_NUM) {
+		std::cout << INVALID_ARG;
+		return 0;
+	}
+	for (int i = VALID_ARG_NUM; i < argc; i ++){
+		if (!latency_parse_option(client_latency, argc, argv, i)){
+			std::cout << INVALID_ARG;
+			return 0;
+		}
+	}
+	if (!latency_apply(client_latency)){
+		std::cout << "ERROR: sched_setaffinity " << errno << "." << std::endl;
+	}
+
+	if (std::string(argv[1]).compare(GATEWAY_OPT) == 0){
+		gateway_listen(argv[2], argv[3]);
+		return 0;
+	}
 
 	// need to know if the connection success or not...
+	// A busy server tells us when to come back - wait that long and try again.
 	char msg [MAX_MSG_LEN];
-	memset(msg, 0, sizeof(msg));
-	client_recv_server_msg(msg);
+	srand(getpid());
+	for (int attempt = 1; ; attempt ++){
+		connect_to_server(argv[2], argv[3]);
+		send_name_to_server(argv[1]);
+		memset(msg, 0, sizeof(msg));
+		client_recv_server_msg(msg);
+		if (strncmp(msg, SERVER_BUSY, strlen(SERVER_BUSY)) != 0 || attempt == MAX_CONNECT_ATTEMPTS){
+			break;
+		}
+		close(sockfd);
+		if (transport == TRANSPORT_SHM){
+			shm_close(shm);
+		}
+		usleep(busy_retry_delay_ms(msg) * 1000);
+	}
+	client_name = argv[1];
 
 	std::string server_response(msg);
 	std::string checkMsg = CON_FAIL + '\n';
-	if (server_response.compare(CATCH_NAME) == 0 || server_response.compare(checkMsg) == 0){
+	if (server_response.compare(CATCH_NAME) == 0 || server_response.compare(checkMsg) == 0 ||
+	    server_response.compare(0, strlen(SERVER_BUSY), SERVER_BUSY) == 0){
 		close(sockfd);
 		exit(1);
 	}
@@ -0,0 +1,1218 @@
+
+// -------------------------------------------- Includes -------------------------------------------
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <stdlib.h>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include "whatsappCore.h"
+#include "whatsappTrace.h"
+#include "whatsappProbes.h"
+
+// -------------------------------------------- Defines --------------------------------------------
+
+#define CATCH_NAME "Client name is already in use.\n"
+
+#define CREATE_GRP_ERR "ERROR: failed to create group \""
+#define WHO_MSG ": Requests the currently connected client names.\n"
+#define SEND_SUCCESS_MSG "Sent successfully.\n"
+#define SEND_ERR_MSG "ERROR: failed to send.\n"
+#define SEND_SOME_ERR_MSG "ERROR: failed to send to "
+#define EXIT_CLIENT_MSG "Unregistered successfully."
+#define HISTORY_ERR_MSG "ERROR: failed to fetch history.\n"
+#define ATTACH_READY_MSG "Ready for the attachment.\n"
+
+#define CONNECTED " connected"
+#define CON_FAIL "Failed to connect the server"
+#define CON_SUCCEED "Connected Successfully.\n"
+
+#define NAME "name"
+#define CREATE_GROUP "create_group"
+#define SEND "send"
+#define WHO "who"
+#define EXIT "exit"
+#define HISTORY "history"
+#define ATTACH "attach"
+
+// ---------------------------------------- Global variables ---------------------------------------
+
+WA_PROBE_LIST(WA_DEFINE_SEMAPHORE) // Raised by a tracer while it is attached to the probe.
+
+slab_pool slab_pools[SLAB_CLASSES];
+
+size_t large_allocs = 0;
+
+scratch_arena loop_arena;
+
+transport_hooks client_transport;
+
+groups_map groupsToClients;
+
+sockets_map clientsToSockets;
+
+sessions_map socketsToSessions;
+
+std::set<int> pendingSockets;
+
+history_map conversationsToHistory;
+
+lru_list historyLru;
+
+conversations_index clientsToConversations;
+
+departed_map departedClients;
+
+departure_list departures;
+
+size_t history_bytes = 0;
+unsigned int history_msgs_cap = DEFAULT_HISTORY_MSGS;
+size_t history_bytes_cap = DEFAULT_HISTORY_BYTES;
+unsigned int history_grace_s = DEFAULT_HISTORY_GRACE_S;
+
+unsigned int shed_lag_ms = DEFAULT_SHED_LAG_MS;
+unsigned int shed_queue = DEFAULT_SHED_QUEUE;
+uint64_t loop_lag_us = 0;
+unsigned int queue_depth = 0;
+unsigned long shed_clients = 0;
+
+unsigned int parallel_fanout_min = DEFAULT_PARALLEL_FANOUT_MIN;
+
+uint64_t request_id = 0;
+
+int trace_fd = -1;
+struct timespec trace_start;
+uint32_t next_trace_id = 0;
+
+// The capture records that were not written to the file yet. trace_buffered grows only after a
+// whole record was copied, so the buffer always holds whole records - trace_flush can write it
+// from a signal handler too.
+char trace_buffer[TRACE_BUFFER_SIZE];
+volatile size_t trace_buffered = 0;
+volatile size_t trace_written = 0; // The part of the buffer a flush already wrote.
+struct timespec trace_oldest; // When the oldest buffered record was added.
+
+// ------------------------------------------ Memory pools -----------------------------------------
+
+/**
+ * Return the index of the smallest slab class that can hold the given size.
+ * @param size the requested size in bytes.
+ * @return the class index, or -1 if the size is bigger than the biggest class.
+ */
+int slab_class (size_t size)
+{
+	size_t block = SLAB_MIN_BLOCK;
+	for (int i = 0; i < SLAB_CLASSES; i ++){
+		if (size <= block){
+			return i;
+		}
+		block <<= 1;
+	}
+	return -1;
+}
+
+/**
+ * Allocate a block from the slab class that fits the given size.
+ * @param size the requested size in bytes.
+ * @return pointer to the allocated block.
+ */
+void* slab_alloc (size_t size)
+{
+	int cls = slab_class(size);
+	if (cls < 0){ // Too big for the pools - go to the system allocator.
+		large_allocs++;
+		return ::operator new(size);
+	}
+
+	slab_pool& pool = slab_pools[cls];
+	if (pool.free_list == NULL){ // The pool is empty - carve a new chunk into blocks.
+		pool.block_size = SLAB_MIN_BLOCK << cls;
+		char* chunk = static_cast<char*>(::operator new(SLAB_CHUNK_SIZE));
+		pool.chunks.push_back(chunk);
+		for (int i = SLAB_CHUNK_SIZE / pool.block_size - 1; i >= 0; i --){
+			void* block = chunk + i * pool.block_size;
+			*static_cast<void**>(block) = pool.free_list;
+			pool.free_list = block;
+		}
+	}
+
+	void* block = pool.free_list;
+	pool.free_list = *static_cast<void**>(block);
+	pool.total_allocs++;
+	if (++pool.in_use > pool.peak){
+		pool.peak = pool.in_use;
+	}
+	return block;
+}
+
+/**
+ * Return a block that was allocated by slab_alloc to its pool.
+ * @param block the block to free.
+ * @param size the size that was requested when the block was allocated.
+ */
+void slab_free (void* block, size_t size)
+{
+	int cls = slab_class(size);
+	if (cls < 0){
+		::operator delete(block);
+		return;
+	}
+	slab_pool& pool = slab_pools[cls];
+	*static_cast<void**>(block) = pool.free_list;
+	pool.free_list = block;
+	pool.in_use--;
+}
+
+/**
+ * Allocate scratch memory that stays valid until the next arena_reset().
+ * @param size the requested size in bytes.
+ * @return pointer to the allocated memory.
+ */
+char* arena_alloc (size_t size)
+{
+	size = (size + 7) & ~(size_t) 7; // Keep the next allocation aligned.
+	while (loop_arena.chunk_index < loop_arena.chunks.size() &&
+	       loop_arena.offset + size > ARENA_CHUNK_SIZE){ // Move on to the next chunk.
+		loop_arena.chunk_index++;
+		loop_arena.offset = 0;
+	}
+	if (loop_arena.chunk_index == loop_arena.chunks.size()){ // All chunks are in use.
+		loop_arena.chunks.push_back(static_cast<char*>(::operator new(std::max(size,
+				(size_t) ARENA_CHUNK_SIZE))));
+		loop_arena.offset = 0;
+	}
+	char* mem = loop_arena.chunks[loop_arena.chunk_index] + loop_arena.offset;
+	loop_arena.offset += size;
+	loop_arena.used += size;
+	if (loop_arena.used > loop_arena.high_water){
+		loop_arena.high_water = loop_arena.used;
+	}
+	return mem;
+}
+
+/**
+ * Release all the scratch memory at once. The chunks are kept for the next pass.
+ */
+void arena_reset ()
+{
+	loop_arena.chunk_index = 0;
+	loop_arena.offset = 0;
+	loop_arena.used = 0;
+	loop_arena.resets++;
+}
+
+// ------------------------------------------- Functions -------------------------------------------
+
+/**
+ * The function recieve a client name and check if it is already exists as a client name or a
+ * group name.
+ * @param client_name the client name.
+ * @return 0 - not exist, 1 - exist as client, 2 - exist as group.
+ */
+int is_name_exist (std::string name)
+{
+	if (groupsToClients.find(name) != groupsToClients.end()){
+		return IS_GROUP_NAME;
+	}
+	if(clientsToSockets.find(name) != clientsToSockets.end())
+	{
+		return IS_CLIENT_NAME;
+	}
+	return NOT_EXIST;
+}
+
+/**
+ * This function check if the client is a member in the group members of the given group name.
+ * @param client_name
+ * @param group_name
+ * @return true if client_name is a member in group_name o.w false
+ */
+bool is_member(std::string client_name, std::string group_name){
+	groups_map::iterator it = groupsToClients.find(group_name);
+
+	if (it != groupsToClients.end()){ // The group is exist
+		const members_set& set = it->second;
+		return set.find(client_name) != set.end();
+	}
+	return false;
+//	return groupsToClients[group_name].find(client_name) != groupsToClients[client_name].end();
+}
+
+/**
+ * Return the client name that cooresponde to the sender_sock.
+ * @param sender_sock the sender socket.
+ * @return the cooresponde client name.
+ */
+std::string get_sender_name (int sender_sock){
+	sessions_map::iterator it = socketsToSessions.find(sender_sock);
+	if (it != socketsToSessions.end()){
+		return it->second->name;
+	}
+	return "";
+}
+
+/**
+ * Append a record to the capture file, if capturing is on.
+ * @param session the session the record belongs to.
+ * @param type TRACE_OPEN, TRACE_FRAME or TRACE_CLOSE.
+ * @param data the frame bytes (only for TRACE_FRAME).
+ * @param length the number of frame bytes.
+ */
+void trace_event (const client_session* session, uint16_t type, const char* data, size_t length)
+{
+	if (trace_fd < 0){
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	trace_record record;
+	record.timestamp_us = (uint64_t) (now.tv_sec - trace_start.tv_sec) * 1000000 +
+	                      (now.tv_nsec - trace_start.tv_nsec) / 1000;
+	record.conn_id = session->trace_id;
+	record.type = type;
+	record.length = (uint16_t) length;
+	if (trace_buffered + sizeof(record) + length > TRACE_BUFFER_SIZE){
+		trace_flush();
+	}
+	if (trace_buffered == 0){
+		trace_oldest = now;
+	}
+	memcpy(trace_buffer + trace_buffered, &record, sizeof(record));
+	if (length > 0){
+		memcpy(trace_buffer + trace_buffered + sizeof(record), data, length);
+	}
+	trace_buffered = trace_buffered + sizeof(record) + length;
+}
+
+/**
+ * Start capturing to the given file - truncate it and write the magic.
+ * @param path the capture file.
+ * @return false if the file can't be opened.
+ */
+bool trace_open (const char* path)
+{
+	if ((trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0){
+		return false;
+	}
+	memcpy(trace_buffer, TRACE_MAGIC, TRACE_MAGIC_LEN);
+	trace_buffered = TRACE_MAGIC_LEN;
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	trace_oldest = trace_start;
+	return true;
+}
+
+/**
+ * Write the buffered capture records to the file. It only calls write(), so the server may call
+ * it from a signal handler, after a crash.
+ */
+void trace_flush ()
+{
+	while (trace_fd >= 0 && trace_written < trace_buffered){
+		ssize_t written = write(trace_fd, trace_buffer + trace_written, trace_buffered - trace_written);
+		if (written < 0 && errno == EINTR){
+			continue;
+		}
+		if (written <= 0){
+			break; // The records are dropped - the file can't take them.
+		}
+		trace_written = trace_written + written;
+	}
+	trace_buffered = 0;
+	trace_written = 0;
+}
+
+/**
+ * Flush the capture records if the oldest of them waited TRACE_FLUSH_MS, so a capture is at most
+ * that much behind when the server dies.
+ * @param now the current CLOCK_MONOTONIC time.
+ */
+void trace_flush_due (const struct timespec& now)
+{
+	if (trace_buffered > 0 && (now.tv_sec - trace_oldest.tv_sec) * 1000 +
+	                          (now.tv_nsec - trace_oldest.tv_nsec) / 1000000 >= TRACE_FLUSH_MS){
+		trace_flush();
+	}
+}
+
+/**
+ * Flush the capture records and close the capture file.
+ */
+void trace_close ()
+{
+	if (trace_fd < 0){
+		return;
+	}
+	trace_flush();
+	close(trace_fd);
+	trace_fd = -1;
+}
+
+/**
+ * Send a message to a client over the transport of its session.
+ * @param sock the client socket.
+ * @param data the message.
+ * @param length the message length.
+ * @return the number of bytes sent, or -1 on error (like send()).
+ */
+ssize_t send_to_client (int sock, const char* data, size_t length)
+{
+	ssize_t result = client_transport.send(sock, data, length);
+	WA_PROBE3(socket__flush, sock, length, result);
+	return result;
+}
+
+/**
+ * Create the session of a newly accepted socket. The session object is taken from the slab pool.
+ * @param sock the new socket.
+ * @param transport the transport the socket was accepted on.
+ */
+void open_session (int sock, int transport)
+{
+	client_session* session = new (slab_alloc(sizeof(client_session))) client_session();
+	session->sock = sock;
+	session->transport = transport;
+	session->trace_id = next_trace_id++;
+	session->waiting = false;
+	socketsToSessions[sock] = session;
+	trace_event(session, TRACE_OPEN, NULL, 0);
+}
+
+/**
+ * Destroy the session of the given socket and return its memory to the slab pool.
+ * @param sock the socket.
+ */
+void close_session (int sock)
+{
+	sessions_map::iterator it = socketsToSessions.find(sock);
+	if (it == socketsToSessions.end()){
+		return;
+	}
+	client_session* session = it->second;
+	trace_event(session, TRACE_CLOSE, NULL, 0);
+	socketsToSessions.erase(it);
+	pendingSockets.erase(sock);
+	session->~client_session();
+	slab_free(session, sizeof(client_session));
+}
+
+/**
+ * This function take care to operate the "who" request.
+ * @param sender_sock the client file descriptor.
+ */
+void server_who(int sender_sock){
+	std::string sender_name = get_sender_name(sender_sock);
+	std::cout << sender_name << WHO_MSG;
+	std::string response = "";
+	for(sockets_map::iterator it = clientsToSockets.begin();
+	    it != clientsToSockets.end(); ++it){
+		response += (*it).first;
+		response += ",";
+	}
+	response = response.substr(0, response.length() - 1) + END_LINE;
+	if (send_to_client(clientsToSockets[sender_name], response.c_str(), response.length()) < 0) {
+		std::cout << "ERROR: send " << errno << "." << std::endl;
+	}
+}
+
+/**
+ * Return the CLOCK_MONOTONIC time in seconds.
+ */
+uint64_t monotonic_s ()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec;
+}
+
+/**
+ * Remove a client from the clients map and from all the groups it's member in. Its direct
+ * conversations and its groups are kept for it for history_grace_s, in case it comes back; then
+ * the conversations are dropped, so a later client with the same name can't read them.
+ * @param client_name the client name.
+ */
+void unregister_client (const std::string& client_name)
+{
+	departed_client departed;
+	for(groups_map::iterator map_iter = groupsToClients.begin();
+		map_iter != groupsToClients.end(); ++map_iter)
+	{
+		if ((*map_iter).second.erase(client_name) > 0){
+			departed.groups.insert((*map_iter).first);
+		}
+	}
+	if (clientsToSockets.erase(client_name) == 0){ // It never registered.
+		return;
+	}
+	history_expire_departed();
+	if (history_grace_s == 0){
+		history_forget_client(client_name);
+		return;
+	}
+	departed.expires = monotonic_s() + history_grace_s;
+	departed.departure = departures.insert(departures.end(), std::make_pair(departed.expires, client_name));
+	departedClients[client_name] = departed;
+}
+
+/**
+ * This function take care to operate the "exit" request.
+ * @param sender_sock the client file descriptor.
+ */
+void server_exit(int sender_sock){
+	std::string client_to_remove = get_sender_name(sender_sock);
+	unregister_client(client_to_remove);
+
+	std::string response = EXIT_CLIENT_MSG;
+	response += "\n";
+	if (send_to_client(sender_sock, response.c_str(), response.length()) < 0) {
+		std::cout << "ERROR: send " << errno << "." << std::endl;
+	}
+	client_transport.disconnect(sender_sock);
+	std::cout << client_to_remove << ": " << EXIT_CLIENT_MSG << std::endl;
+}
+
+/**
+ * Return the history key of a conversation - the group name, or the two client names sorted.
+ * @param name a client name or a group name.
+ * @param other_client the other client in a direct conversation, empty for a group.
+ * @return the conversation key.
+ */
+std::string conversation_key (const std::string& name, const std::string& other_client)
+{
+	if (other_client.empty()){
+		return name;
+	}
+	return name < other_client ? name + "," + other_client : other_client + "," + name;
+}
+
+/**
+ * Drop the oldest entry of a conversation.
+ * @param history the conversation history.
+ */
+void history_drop_oldest (conversation_history& history)
+{
+	uint16_t length;
+	memcpy(&length, history.data.data() + history.start + sizeof(uint32_t), sizeof(length));
+	history.start += HISTORY_ENTRY_HEADER + length;
+	history.count--;
+	if (history.start > history.data.length() / 2){ // Compact the buffer.
+		history_bytes -= history.start;
+		history.data.erase(0, history.start);
+		history.start = 0;
+	}
+}
+
+/**
+ * Add a direct conversation to the index of its two clients, or remove it.
+ * @param key the conversation key - "client,client", a group name is ignored.
+ * @param add true to add it, false to remove it.
+ */
+void history_index (const std::string& key, bool add)
+{
+	size_t comma = key.find(',');
+	if (comma == std::string::npos){
+		return;
+	}
+	std::string clients[2] = {key.substr(0, comma), key.substr(comma + 1)};
+	for (int i = 0; i < 2; i ++){
+		if (add){
+			clientsToConversations[clients[i]].insert(key);
+			continue;
+		}
+		conversations_index::iterator it = clientsToConversations.find(clients[i]);
+		if (it != clientsToConversations.end()){
+			it->second.erase(key);
+			if (it->second.empty()){
+				clientsToConversations.erase(it);
+			}
+		}
+	}
+}
+
+/**
+ * Drop a whole conversation.
+ * @param it the conversation in conversationsToHistory.
+ */
+void history_erase (history_map::iterator it)
+{
+	history_index(it->first, false);
+	history_bytes -= it->second.data.length() + it->first.length() + HISTORY_CONV_OVERHEAD;
+	historyLru.erase(it->second.lru);
+	conversationsToHistory.erase(it);
+}
+
+/**
+ * Evict whole conversations, the least recently used first, until the histories fit their cap.
+ */
+void history_evict ()
+{
+	while (history_bytes > history_bytes_cap && !historyLru.empty()){
+		history_erase(conversationsToHistory.find(historyLru.back()));
+	}
+}
+
+/**
+ * Drop the direct conversations of a client, found through its index.
+ * @param client_name the client name.
+ */
+void history_forget_client (const std::string& client_name)
+{
+	conversations_index::iterator it = clientsToConversations.find(client_name);
+	if (it == clientsToConversations.end()){
+		return;
+	}
+	members_set keys;
+	keys.swap(it->second); // history_erase updates the index.
+	for (members_set::iterator key = keys.begin(); key != keys.end(); ++key){
+		history_map::iterator history = conversationsToHistory.find(*key);
+		if (history != conversationsToHistory.end()){
+			history_erase(history);
+		}
+	}
+}
+
+/**
+ * Drop the direct conversations of the clients whose grace period ended without them coming back.
+ */
+void history_expire_departed ()
+{
+	uint64_t now = monotonic_s();
+	while (!departures.empty() && departures.front().first <= now){
+		departed_map::iterator it = departedClients.find(departures.front().second);
+		if (it != departedClients.end()){
+			history_forget_client(it->first);
+			departedClients.erase(it);
+		}
+		departures.pop_front();
+	}
+}
+
+/**
+ * Add a message line to the history of a conversation.
+ * @param key the conversation key.
+ * @param line the line that was delivered ("sender: message", without the end of line).
+ * @param length the line length.
+ */
+void history_record (const std::string& key, const char* line, size_t length)
+{
+	history_map::iterator it = conversationsToHistory.find(key);
+	if (it == conversationsToHistory.end()){
+		it = conversationsToHistory.insert(std::make_pair(key, conversation_history())).first;
+		historyLru.push_front(key);
+		it->second.lru = historyLru.begin();
+		history_bytes += key.length() + HISTORY_CONV_OVERHEAD;
+		history_index(key, true);
+	}
+	else{ // Move the conversation to the front of the LRU list.
+		historyLru.splice(historyLru.begin(), historyLru, it->second.lru);
+	}
+
+	conversation_history& history = it->second;
+	uint32_t seq = ++history.next_seq;
+	uint16_t entry_length = (uint16_t) length;
+	history.data.append(reinterpret_cast<const char*>(&seq), sizeof(seq));
+	history.data.append(reinterpret_cast<const char*>(&entry_length), sizeof(entry_length));
+	history.data.append(line, entry_length);
+	history.count++;
+	history_bytes += HISTORY_ENTRY_HEADER + entry_length;
+
+	while (history.count > history_msgs_cap){
+		history_drop_oldest(history);
+	}
+	history_evict();
+}
+
+/**
+ * This function take care to operate the "history" request - it sends all the messages of the
+ * conversation with a client (or of a group the sender is a member in) that are newer than the
+ * given sequence number, in one response: a header line with the number of messages and then a
+ * "<sequence number> <sender>: <message>" line for each one.
+ * @param sender_sock the client file descriptor.
+ * @param command the client or group name, and optionally the last sequence number already seen.
+ */
+void server_history (int sender_sock, std::string command)
+{
+	std::string sender = get_sender_name(sender_sock);
+	std::string name = command.substr(0, command.find(" "));
+	uint32_t since = 0;
+	if (command.find(" ") != std::string::npos){
+		since = (uint32_t) strtoul(command.substr(command.find(" ") + 1).c_str(), NULL, 10);
+	}
+
+	std::string key;
+	int name_type = is_name_exist(name);
+	if (name_type == IS_GROUP_NAME && is_member(sender, name)){
+		key = conversation_key(name, "");
+	}
+	else if (name_type != IS_GROUP_NAME && !sender.empty() && name.compare(sender) != 0 &&
+	         (name_type == IS_CLIENT_NAME || conversationsToHistory.count(conversation_key(name, sender)))){
+		key = conversation_key(name, sender); // Kept until either client is gone past its grace period.
+	}
+	else{
+		std::cout << sender << ": " << HISTORY_ERR_MSG;
+		std::string error_msg = HISTORY_ERR_MSG;
+		if (send_to_client(sender_sock, error_msg.c_str(), error_msg.length()) < 0) {
+			std::cout << "ERROR: send " << errno << "." << std::endl;
+		}
+		return;
+	}
+
+	std::string lines;
+	unsigned int count = 0;
+	history_map::iterator it = conversationsToHistory.find(key);
+	if (it != conversationsToHistory.end()){
+		historyLru.splice(historyLru.begin(), historyLru, it->second.lru);
+		const pool_string& data = it->second.data;
+		for (size_t offset = it->second.start; offset < data.length(); ){
+			uint32_t seq;
+			uint16_t length;
+			memcpy(&seq, data.data() + offset, sizeof(seq));
+			memcpy(&length, data.data() + offset + sizeof(seq), sizeof(length));
+			if (seq > since){
+				std::ostringstream entry;
+				entry << seq << " ";
+				lines += entry.str();
+				lines.append(data.data() + offset + HISTORY_ENTRY_HEADER, length);
+				lines += END_LINE;
+				count++;
+			}
+			offset += HISTORY_ENTRY_HEADER + length;
+		}
+	}
+
+	std::ostringstream header;
+	header << count << " messages in the history of " << name << "." << END_LINE;
+	std::string response = header.str() + lines;
+	if (send_to_client(sender_sock, response.c_str(), response.length()) < 0) {
+		std::cout << "ERROR: send " << errno << "." << std::endl;
+	}
+	std::cout << sender << ": Requests the history of " << name << "." << std::endl;
+}
+
+/**
+ * Return the response to a sender whose message did not reach some of its receivers.
+ * @param failed the comma separated receivers that did not get it.
+ */
+std::string send_failed_msg (const std::string& failed)
+{
+	return SEND_SOME_ERR_MSG + failed + "." + END_LINE;
+}
+
+/**
+ * Build the frame of a message - the line every receiver gets, "<sender>: <msg>\n". Its buffer comes
+ * from the slab pools. Without its end of line, it is also the line the history keeps.
+ * @param sender the sender name.
+ * @param msg the message.
+ * @return the frame.
+ */
+pool_string message_frame (const std::string& sender, const std::string& msg)
+{
+	pool_string frame;
+	frame.reserve(sender.length() + msg.length() + 3);
+	frame.append(sender.data(), sender.length());
+	frame.append(": ");
+	frame.append(msg.data(), msg.length());
+	frame.append(END_LINE);
+	return frame;
+}
+
+/**
+ * This function take care to operate a "send" request with a comma separated list of receivers.
+ * The message is built once and sent to every listed client, and to the members of every listed
+ * group the sender is a member in, each of them once. The sender gets one response that lists the
+ * receivers that failed.
+ * @param sender_sock the client file descriptor.
+ * @param receivers the comma separated receivers.
+ * @param msg the message.
+ */
+void server_send_multi (int sender_sock, const std::string& receivers, const std::string& msg)
+{
+	std::string sender = get_sender_name(sender_sock);
+	pool_string frame = message_frame(sender, msg);
+	std::set<std::string> delivered; // Every client gets the message once.
+	delivered.insert(sender);
+	std::string failed = "";
+	WA_PROBE2(fanout__start, request_id, std::count(receivers.begin(), receivers.end(), ',') + 1);
+
+	std::stringstream stringStream(receivers);
+	std::string receiver;
+	while (getline(stringStream, receiver, ',')){
+		int receiver_type = is_name_exist(receiver);
+		if (receiver_type == IS_CLIENT_NAME && receiver.compare(sender) != 0){
+			if (!delivered.insert(receiver).second){ // Already got it through a listed group.
+				continue;
+			}
+			if (send_to_client(clientsToSockets[receiver], frame.data(), frame.length()) < 0) {
+				std::cout << "ERROR: send " << errno << "." << std::endl;
+				failed += receiver + ",";
+				continue;
+			}
+			history_record(conversation_key(receiver, sender), frame.data(), frame.length() - 1);
+		}
+		else if (receiver_type == IS_GROUP_NAME && is_member(sender, receiver)){
+			const members_set& members = groupsToClients[receiver];
+			for (members_set::const_iterator it = members.begin(); it != members.end(); ++it){
+				if (delivered.insert(*it).second &&
+				    send_to_client(clientsToSockets[*it], frame.data(), frame.length()) < 0) {
+					std::cout << "ERROR: send " << errno << "." << std::endl;
+				}
+			}
+			history_record(conversation_key(receiver, ""), frame.data(), frame.length() - 1);
+		}
+		else{
+			failed += receiver + ",";
+		}
+	}
+	WA_PROBE2(fanout__done, request_id, delivered.size() - 1);
+
+	std::string client_msg = SEND_SUCCESS_MSG;
+	if (failed.empty()){
+		std::cout << sender + ": \"" + msg + "\" was sent successfully to " + receivers + "."
+		          << std::endl;
+	}
+	else{
+		failed = failed.substr(0, failed.length() - 1);
+		std::cout << sender + ": ERROR: failed to send \"" + msg + "\" to " + failed + "."
+		          << std::endl;
+		client_msg = send_failed_msg(failed);
+	}
+	if (send_to_client(sender_sock, client_msg.c_str(), client_msg.length()) < 0) {
+		std::cout << "ERROR: send " << errno << "." << std::endl;
+	}
+}
+
+/**
+ * Hand the fan-out of a big group to the transport, which sends it in the background and acks the
+ * sender when it is done (the fanout__done probe fires then too).
+ * @param sender_sock the sender socket.
+ * @param sender the sender name.
+ * @param members the group members.
+ * @param frame the message every member except the sender gets.
+ * @return false if the fan-out must be sent inline.
+ */
+bool fan_out_in_background (int sender_sock, const std::string& sender, const members_set& members,
+                            const pool_string& frame)
+{
+	if (parallel_fanout_min == 0 || client_transport.fan_out == NULL ||
+	    members.size() - 1 <= parallel_fanout_min){ // The sender is a member, not a receiver.
+		return false;
+	}
+	std::vector<int> recipients;
+	recipients.reserve(members.size());
+	for (members_set::const_iterator it = members.begin(); it != members.end(); ++it){
+		if ((*it).compare(sender) != 0){
+			recipients.push_back(clientsToSockets[*it]);
+		}
+	}
+	// The workers get their own copy of the frame - the slab pools belong to the loop thread.
+	return client_transport.fan_out(sender_sock, recipients, std::string(frame.data(), frame.length()),
+	                                SEND_SUCCESS_MSG);
+}
+
+/**
+ * This function take care to operate the "send" request.
+ * @param sender_sock the client file descriptor.
+ * @param command the details of the message - who receive the message and what is the message.
+ */
+void server_send(int sender_sock, std::string command){
+	std::string sender = get_sender_name(sender_sock);
+	std::string receiver = command.substr(0, command.find(" "));
+	std::string msg = command.substr(command.find(" ") + 1);
+	std::string client_msg = "";
+
+	if (receiver.find(",") != std::string::npos){ // Several receivers.
+		server_send_multi(sender_sock, receiver, msg);
+		return;
+	}
+
+	switch (is_name_exist(receiver)){
+		case(IS_CLIENT_NAME):
+		{
+			pool_string frame = message_frame(sender, msg);
+			// Send the message to the receiver
+			if (send_to_client(clientsToSockets[receiver], frame.data(), frame.length()) < 0) {
+				std::cout << "ERROR: send " << errno << "." << std::endl;
+				std::string error_msg = SEND_ERR_MSG; // The sender waits for an answer.
+				if (send_to_client(sender_sock, error_msg.c_str(), error_msg.length()) < 0) {
+					std::cout << "ERROR: send " << errno << "." << std::endl;
+				}
+				return;
+			}
+			history_record(conversation_key(receiver, sender), frame.data(), frame.length() - 1);
+			std::cout << sender + ": \"" + command.substr(command.find(" ") + 1)
+			             + "\" was sent successfully to " + receiver + "." << std::endl;
+
+			client_msg = SEND_SUCCESS_MSG;
+			// Success message to the sender.
+			if (send_to_client(sender_sock, client_msg.c_str(), client_msg.length()) < 0) {
+				std::cout << "ERROR: send " << errno << "." << std::endl;
+				return;
+			}
+			break;
+		}
+		case(IS_GROUP_NAME): // receiver = group name
+		{
+			if(!is_member(sender, receiver)){
+				std::cout << sender + ": ERROR: failed to send \"" + msg + "\" to " + receiver +
+						"." << std::endl;
+				std::string error_msg = SEND_ERR_MSG;
+				if (send_to_client(sender_sock, error_msg.c_str(), error_msg.length()) < 0) {
+					std::cout << "ERROR: send " << errno << "." << std::endl;
+					return;
+				}
+				break;
+			}
+			pool_string frame = message_frame(sender, msg);
+			// Send message to all group members.
+			size_t delivered = 0;
+			WA_PROBE2(fanout__start, request_id, groupsToClients[receiver].size() - 1);
+			if (fan_out_in_background(sender_sock, sender, groupsToClients[receiver], frame)){
+				history_record(conversation_key(receiver, ""), frame.data(), frame.length() - 1);
+				std::cout << sender + ": \"" + msg + "\" is sent to " + receiver + " in the background."
+				          << std::endl;
+				break;
+			}
+			for(members_set::iterator it = groupsToClients[receiver].begin();
+			    it != groupsToClients[receiver].end(); ++it)
+			{
+				// If the current client is the sender don't send him the message. A member that
+				// can't take it (its queue is full, or it is gone) does not stop the others.
+				if ((*it).compare(sender) != 0){
+					if (send_to_client(clientsToSockets[*it], frame.data(), frame.length()) < 0) {
+						std::cout << "ERROR: send " << errno << "." << std::endl;
+						continue;
+					}
+					delivered++;
+				}
+			}
+			WA_PROBE2(fanout__done, request_id, delivered);
+
+			history_record(conversation_key(receiver, ""), frame.data(), frame.length() - 1);
+
+			client_msg = SEND_SUCCESS_MSG;
+			// Success message to the sender.
+			if (send_to_client(sender_sock, client_msg.c_str(), client_msg.length()) < 0) {
+				std::cout << "ERROR: send " << errno << "." << std::endl;
+				return;
+			}
+
+			std::cout << sender + ": \"" + command.substr(command.find(" ") + 1)
+			             + "\" was sent successfully to " + receiver + "." << std::endl;
+			break;
+		}
+		default: // not exist
+		{
+			std::cout << sender + ": ERROR: failed to send \"" + msg + "\" to " + receiver + "."
+			          << std::endl;
+			std::string error_msg = SEND_ERR_MSG;
+			if (send_to_client(sender_sock, error_msg.c_str(), error_msg.length()) < 0) {
+				std::cout << "ERROR: send " << errno << "." << std::endl;
+				return;
+			}
+			break;
+		}
+	}
+}
+
+/**
+ * This function take care to operate the "create_group" request.
+ * @param sender_sock the client file descriptor.
+ * @param command the name of the group to create and it's members.
+ */
+void server_create_group (int sender_sock, std::string command)
+{
+	std::string sender = get_sender_name(sender_sock);
+	std::string groupName = command.substr(0, command.find(" "));
+	std::string members = command.substr(command.find(" ") + 1);
+
+	// If the group name is already exists (as a group name / client name).
+	// OR if a client wants to open a group for himself.
+	if (is_name_exist(groupName) != 0 || members.compare(sender) == 0){
+		std::string err_msg = CREATE_GRP_ERR + groupName + "\".";
+		std::cout << sender << ": " << err_msg << std::endl;
+		err_msg += "\n";
+		if (send_to_client(clientsToSockets[sender], err_msg.c_str(), err_msg.length()) < 0) {
+			std::cout << "ERROR: send " << errno << "." << std::endl;
+		}
+		return;
+	}
+
+	// If no error - create group.
+	members_set group_members;
+	std::stringstream stringStream(members);
+	std::string token;
+	while(getline(stringStream, token, ','))
+	{
+		// If the current member is a client of the server - we can add it to the group.
+		if (clientsToSockets.find(token) != clientsToSockets.end()){
+			group_members.insert(token);
+		}
+		// The current member is not a client of the server - error
+		else{
+			std::string err_msg = CREATE_GRP_ERR + groupName + "\".";
+			std::cout << sender << ": " << err_msg << std::endl;
+			err_msg += "\n";
+			if (send_to_client(clientsToSockets[sender], err_msg.c_str(), err_msg.length()) < 0) {
+				std::cout << "ERROR: send " << errno << "." << std::endl;
+			}
+			return;
+		}
+	}
+	group_members.insert(sender); // The sender is also a member in the group.
+
+	groupsToClients[groupName] = group_members;
+	std::string msg = "Group \"" + groupName + "\" was created successfully.";
+	std::cout << sender << ": " << msg << std::endl;
+	msg += "\n";
+	if (send_to_client(clientsToSockets[sender], msg.c_str(), msg.length()) < 0) {
+		std::cout << "ERROR: send " << errno << "." << std::endl;
+	}
+}
+
+/**
+ * Check that an attachment name can be used as a file name by the receivers - only letters,
+ * digits, '.', '_' and '-', and it does not start with '.'.
+ */
+bool is_attachment_name (const std::string& name)
+{
+	if (name.empty() || name.length() > MAX_ATTACHMENT_NAME_LEN || name[0] == '.'){
+		return false;
+	}
+	for (size_t i = 0; i < name.length(); i ++){
+		if (!isalnum((unsigned char) name[i]) && name[i] != '.' && name[i] != '_' && name[i] != '-'){
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * This function take care to operate the "attach" request - the sender announces a file for a
+ * client or a group, and its bytes follow the request. They are not parsed here: the transport
+ * takes them and delivers them to the receivers after an ATTACHMENT_HEADER line, and acks the
+ * sender once it has them all.
+ * @param sender_sock the client file descriptor.
+ * @param command the receiver, the size in bytes and the name of the attachment.
+ */
+void server_attach (int sender_sock, std::string command)
+{
+	std::string sender = get_sender_name(sender_sock);
+	std::istringstream fields(command);
+	std::string receiver, name;
+	unsigned long long size = 0;
+	fields >> receiver >> size >> name;
+
+	std::vector<int> recipients;
+	int receiver_type = is_name_exist(receiver);
+	if (receiver_type == IS_CLIENT_NAME && receiver.compare(sender) != 0){
+		recipients.push_back(clientsToSockets[receiver]);
+	}
+	else if (receiver_type == IS_GROUP_NAME && is_member(sender, receiver)){
+		const members_set& members = groupsToClients[receiver];
+		for (members_set::const_iterator it = members.begin(); it != members.end(); ++it){
+			if ((*it).compare(sender) != 0){
+				recipients.push_back(clientsToSockets[*it]);
+			}
+		}
+	}
+
+	std::ostringstream header;
+	header << ATTACHMENT_HEADER << sender << " " << name << " " << size << END_LINE;
+	if (sender.empty() || recipients.empty() || size == 0 || size > MAX_ATTACHMENT_SIZE ||
+	    !is_attachment_name(name) ||
+	    !client_transport.receive_attachment(sender_sock, recipients, size, header.str())){
+		std::cout << sender + ": ERROR: failed to send attachment \"" + name + "\" to " + receiver + "."
+		          << std::endl;
+		std::string error_msg = SEND_ERR_MSG;
+		if (send_to_client(sender_sock, error_msg.c_str(), error_msg.length()) < 0) {
+			std::cout << "ERROR: send " << errno << "." << std::endl;
+		}
+		return;
+	}
+	std::cout << sender << ": sends attachment \"" << name << "\" (" << size << " bytes) to "
+	          << receiver << "." << std::endl;
+	std::string ready_msg = ATTACH_READY_MSG;
+	if (send_to_client(sender_sock, ready_msg.c_str(), ready_msg.length()) < 0) {
+		std::cout << "ERROR: send " << errno << "." << std::endl;
+	}
+}
+
+/**
+ * This function receive a client request, parse it and send it to the coorespond function to
+ * handle it.
+ * @param req the request.
+ * @param curr_sock the socket file descriptor of the client.
+ */
+void handle_client_request (char* req, int curr_sock)
+{
+	std::string request = req;
+	request = request.substr(0, request.find(END_LINE));
+	std::string operation = request.substr(0, request.find(" "));
+	WA_PROBE2(command__parsed, request_id, operation.c_str());
+	if (operation.compare(NAME) == 0){
+		std::string arguments = request.substr(request.find(" ") + 1);
+		add_new_client(curr_sock, arguments);
+	}
+	else if (operation.compare(CREATE_GROUP) == 0){
+		std::string arguments = request.substr(request.find(" ") + 1);
+		WA_PROBE2(create_group__entry, request_id, arguments.length());
+		server_create_group(curr_sock, arguments);
+		WA_PROBE1(create_group__return, request_id);
+	}
+	else if (operation.compare(SEND) == 0){
+		std::string arguments = request.substr(request.find(" ") + 1);
+		WA_PROBE2(send__entry, request_id, arguments.length());
+		server_send(curr_sock, arguments);
+		WA_PROBE1(send__return, request_id);
+	}
+	else if (operation.compare(WHO) == 0){
+		WA_PROBE2(who__entry, request_id, 0);
+		server_who(curr_sock);
+		WA_PROBE1(who__return, request_id);
+	}
+	else if (operation.compare(EXIT) == 0){
+		WA_PROBE2(exit__entry, request_id, 0);
+		server_exit(curr_sock);
+		WA_PROBE1(exit__return, request_id);
+	}
+	else if (operation.compare(HISTORY) == 0){
+		std::string arguments = request.substr(request.find(" ") + 1);
+		server_history(curr_sock, arguments);
+	}
+	else if (operation.compare(ATTACH) == 0){
+		std::string arguments = request.substr(request.find(" ") + 1);
+		server_attach(curr_sock, arguments);
+	}
+	else if (operation.compare(SHM_ATTACH) == 0){
+		client_transport.attach_shm(curr_sock);
+	}
+}
+
+/**
+ * This function add new client to the inner server's data structures.
+ * @param current_socket - the new socket
+ * @param client_name - the client name.
+ */
+void add_new_client (int current_socket, std::string client_name)
+{
+	std::string newClient = client_name.substr(0, client_name.find(END_LINE));
+
+	// Under load, turn new clients away so the connected ones keep their latency.
+	if ((shed_lag_ms > 0 && loop_lag_us > (uint64_t) shed_lag_ms * 1000) ||
+	    (shed_queue > 0 && queue_depth > shed_queue)){
+		shed_clients++;
+		client_transport.reject(current_socket, std::max((uint64_t) MIN_RETRY_AFTER_MS, loop_lag_us / 500));
+		client_transport.disconnect(current_socket);
+		return;
+	}
+
+	// The client is not already exist
+	if (clientsToSockets.find(newClient) == clientsToSockets.end())
+	{
+		clientsToSockets[newClient] = current_socket;
+		socketsToSessions[current_socket]->name = newClient;
+		history_expire_departed();
+		departed_map::iterator departed = departedClients.find(newClient);
+		if (departed != departedClients.end()){ // It came back in time - it rejoins its groups.
+			for (members_set::iterator it = departed->second.groups.begin();
+			     it != departed->second.groups.end(); ++it){
+				groups_map::iterator group = groupsToClients.find(*it);
+				if (group != groupsToClients.end()){
+					group->second.insert(newClient);
+				}
+			}
+			departures.erase(departed->second.departure);
+			departedClients.erase(departed);
+		}
+		std::cout << newClient << CONNECTED << std::endl;
+		std::string success_msg = CON_SUCCEED;
+		if (send_to_client(current_socket, success_msg.c_str(), success_msg.length()) < 0) {
+			std::cout << "ERROR: send " << errno << "." << std::endl;
+		}
+	}
+	else // Client name is already exist
+	{
+		std::string catch_name = CATCH_NAME;
+		if (send_to_client(current_socket, catch_name.c_str(), catch_name.length()) < 0) {
+			std::cout << "ERROR: send " << errno << "." << std::endl;
+		}
+		// Remove the socket file descriptor from all lists it's member in.
+		client_transport.disconnect(current_socket);
+		std::cout << CON_FAIL << std::endl;
+	}
+}
+
+/**
+ * Check if the session input buffer holds a whole request - a line, or MAX_MSG_LEN bytes of one.
+ */
+bool has_whole_request (const client_session* session)
+{
+	return session->inbuf.find('\n') != pool_string::npos || session->inbuf.length() >= MAX_MSG_LEN;
+}
+
+/**
+ * Handle the whole requests in the session input buffer, up to the request budget of one pass.
+ * A request that is longer than MAX_MSG_LEN is cut, like the fixed receive buffer used to do.
+ * @param sock the client socket.
+ */
+void serve_client_requests (int sock)
+{
+	for (int served = 0; served < REQUEST_BUDGET; served ++){
+		// Handling "exit" destroys the session, so look it up again before every request.
+		sessions_map::iterator it = socketsToSessions.find(sock);
+		if (it == socketsToSessions.end()){
+			break;
+		}
+		client_session* session = it->second;
+		if (session->waiting){ // The requests after a background fan-out wait for its end.
+			break;
+		}
+		size_t end = session->inbuf.find('\n');
+		if (end == pool_string::npos){
+			if (session->inbuf.length() < MAX_MSG_LEN){
+				break; // Wait for the rest of the request.
+			}
+			end = MAX_MSG_LEN - 1;
+		}
+
+		// The frame lives in the loop arena until the end of this pass.
+		char* msg = arena_alloc(end + 2);
+		memcpy(msg, session->inbuf.data(), end + 1);
+		msg[end + 1] = '\0';
+		session->inbuf.erase(0, end + 1);
+
+		trace_event(session, TRACE_FRAME, msg, end + 1);
+		request_id++;
+		WA_PROBE3(frame__received, request_id, sock, end + 1);
+		handle_client_request(msg, sock);
+		WA_PROBE1(request__done, request_id);
+	}
+	update_pending(sock);
+}
+
+/**
+ * Keep pendingSockets up to date for a connection - it has requests left for the next pass of the
+ * event loop, because it used up its budget. Called whenever its input, or its waiting state,
+ * changed, so the loop knows without looking at every connection if it must not block in select.
+ * @param sock the client socket (its session may be gone).
+ */
+void update_pending (int sock)
+{
+	sessions_map::iterator it = socketsToSessions.find(sock);
+	if (it == socketsToSessions.end() || it->second->waiting){
+		pendingSockets.erase(sock);
+		return;
+	}
+	client_session* session = it->second;
+	if (has_whole_request(session) || (session->transport == TRANSPORT_SHM && !shm_ring_empty(session->shm.in))){
+		pendingSockets.insert(sock);
+	}
+	else{
+		pendingSockets.erase(sock);
+	}
+}
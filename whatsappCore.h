@@ -0,0 +1,324 @@
+#ifndef WHATSAPP_CORE_H
+#define WHATSAPP_CORE_H
+
+// -------------------------------------------- Includes -------------------------------------------
+
+#include <map>
+#include <list>
+#include <set>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "whatsappShm.h"
+
+// The server core - the client directory, the groups, the histories, the request parsing and the
+// handlers. It does not know about sockets or the event loop: everything it sends to a client, and
+// every connection it is done with, goes through the transport hooks, so it can be driven in-process
+// (see whatsappBench.cpp) as well as by the server event loop.
+
+// -------------------------------------------- Defines --------------------------------------------
+
+#define TRANSPORT_TCP 0
+#define TRANSPORT_UNIX 1
+#define TRANSPORT_SHM 2
+
+#define NOT_EXIST 0
+#define IS_CLIENT_NAME 1
+#define IS_GROUP_NAME 2
+
+#define MAX_MSG_LEN 256
+#define REQUEST_BUDGET 8 // The requests of one connection we handle in one pass of the event loop.
+
+#define END_LINE "\n"
+
+#define SLAB_MIN_BLOCK 16 // The smallest slab class, every next class is twice as big.
+#define SLAB_CLASSES 10 // 16 bytes to 8 KB - the map nodes, and the message and receive buffers.
+#define SLAB_CHUNK_SIZE 65536 // The chunk of every class is carved into as many blocks as fit.
+#define ARENA_CHUNK_SIZE 16384
+
+#define DEFAULT_HISTORY_MSGS 100 // The messages kept per conversation.
+#define DEFAULT_HISTORY_BYTES (128 << 20) // The memory all the conversations may take together.
+#define HISTORY_ENTRY_HEADER 6 // uint32 sequence number + uint16 length.
+#define HISTORY_CONV_OVERHEAD 128 // Approximate bytes of the map and LRU nodes of a conversation.
+#define DEFAULT_HISTORY_GRACE_S 600 // How long a client that left may come back to its histories.
+
+#define DEFAULT_SHED_LAG_MS 100 // Reject new clients when one pass of the loop takes longer.
+#define DEFAULT_SHED_QUEUE 256 // Reject new clients when more connections wait with requests.
+#define MIN_RETRY_AFTER_MS 100
+
+#define DEFAULT_PARALLEL_FANOUT_MIN 128 // Groups with more receivers fan out on the transport's workers.
+
+#define TRACE_BUFFER_SIZE (1 << 16) // The capture records are written out when this much is buffered.
+#define TRACE_FLUSH_MS 100 // ... or when the oldest buffered record is this old.
+
+#define ATTACHMENT_HEADER "@attachment " // Starts the line that comes before the bytes of an attachment.
+#define MAX_ATTACHMENT_SIZE (256 << 20)
+#define MAX_ATTACHMENT_NAME_LEN 64
+
+// ------------------------------------------ Memory pools -----------------------------------------
+
+/**
+ * A pool of fixed size blocks. Blocks are carved out of big chunks that are never returned to the
+ * system, and freed blocks are kept in a free list for the next allocation of the same class.
+ */
+struct slab_pool {
+	size_t block_size;
+	void* free_list;
+	std::vector<char*> chunks;
+	size_t in_use;
+	size_t peak;
+	size_t total_allocs;
+};
+
+/**
+ * A bump allocator for scratch memory that lives only during one pass of the event loop.
+ */
+struct scratch_arena {
+	std::vector<char*> chunks;
+	size_t chunk_index;
+	size_t offset;
+	size_t used;
+	size_t high_water;
+	size_t resets;
+};
+
+extern slab_pool slab_pools[SLAB_CLASSES]; // The size classed pools, indexed by slab_class().
+
+extern size_t large_allocs; // Allocations that were too big for any slab class.
+
+extern scratch_arena loop_arena; // Scratch memory of the current event loop pass.
+
+int slab_class (size_t size);
+
+void* slab_alloc (size_t size);
+
+void slab_free (void* block, size_t size);
+
+char* arena_alloc (size_t size);
+
+void arena_reset ();
+
+/**
+ * An STL allocator that takes the nodes of the server's maps and sets from the slab pools.
+ */
+template <typename T>
+struct pool_allocator {
+	typedef T value_type;
+
+	pool_allocator () {}
+
+	template <typename U>
+	pool_allocator (const pool_allocator<U>&) {}
+
+	T* allocate (size_t n)
+	{
+		return static_cast<T*>(slab_alloc(n * sizeof(T)));
+	}
+
+	void deallocate (T* p, size_t n)
+	{
+		slab_free(p, n * sizeof(T));
+	}
+};
+
+template <typename T, typename U>
+bool operator== (const pool_allocator<T>&, const pool_allocator<U>&) { return true; }
+
+template <typename T, typename U>
+bool operator!= (const pool_allocator<T>&, const pool_allocator<U>&) { return false; }
+
+// A string whose buffer comes from the slab pools - the message frames, the receive buffers and the
+// histories. Only the event loop thread may use one.
+typedef std::basic_string<char, std::char_traits<char>, pool_allocator<char>> pool_string;
+
+// --------------------------------------------- Types ---------------------------------------------
+
+/**
+ * A connected socket and the client name that was registered on it (empty until "name" arrives).
+ */
+struct client_session {
+	int sock;
+	std::string name;
+	uint32_t trace_id; // The connection id in the capture file.
+	int transport; // TRANSPORT_TCP, TRANSPORT_UNIX or TRANSPORT_SHM.
+	shm_endpoint shm; // The shared-memory channel of a TRANSPORT_SHM session.
+	int shm_memfd; // The file behind the channel, kept to hand it over on a hot restart.
+	pool_string inbuf; // Received bytes that do not form a whole request yet.
+	std::string outbuf; // Output that did not fit in the socket buffer (or the ring) yet (the fan-out
+	                    // workers append to it, so it is not a pool_string).
+	bool waiting; // A fan-out of this client runs in the background - its next requests wait for it.
+};
+
+typedef std::set<std::string, std::less<std::string>, pool_allocator<std::string>> members_set;
+
+typedef std::map<std::string, members_set, std::less<std::string>,
+		pool_allocator<std::pair<const std::string, members_set>>> groups_map;
+
+typedef std::map<std::string, int, std::less<std::string>,
+		pool_allocator<std::pair<const std::string, int>>> sockets_map;
+
+typedef std::map<int, client_session*, std::less<int>,
+		pool_allocator<std::pair<const int, client_session*>>> sessions_map;
+
+typedef std::list<std::string, pool_allocator<std::string>> lru_list;
+
+/**
+ * The recent messages of one conversation (a group, or two clients). The entries are kept back to
+ * back in one buffer - [uint32 sequence number][uint16 length][line] - from the oldest at start to
+ * the newest at the end. Dropped entries are only skipped by start, and the buffer is compacted
+ * when they take more than half of it.
+ */
+struct conversation_history {
+	pool_string data;
+	size_t start;
+	unsigned int count;
+	uint32_t next_seq;
+	lru_list::iterator lru; // The position of the conversation in historyLru.
+};
+
+typedef std::map<std::string, conversation_history, std::less<std::string>,
+		pool_allocator<std::pair<const std::string, conversation_history>>> history_map;
+
+typedef std::map<std::string, members_set, std::less<std::string>,
+		pool_allocator<std::pair<const std::string, members_set>>> conversations_index;
+
+typedef std::list<std::pair<uint64_t, std::string>> departure_list;
+
+/**
+ * A client that left. If a client registers with its name before the record expires, it is the
+ * same client coming back: it rejoins its groups, and its direct conversations were kept for it.
+ */
+struct departed_client {
+	uint64_t expires; // CLOCK_MONOTONIC seconds.
+	members_set groups;
+	departure_list::iterator departure; // Its entry in departures.
+};
+
+typedef std::map<std::string, departed_client, std::less<std::string>,
+		pool_allocator<std::pair<const std::string, departed_client>>> departed_map;
+
+/**
+ * What the core needs from the layer that owns the connections.
+ */
+struct transport_hooks {
+	// Send bytes to a client. Returns the number of bytes sent, or -1 on error (like send()).
+	ssize_t (*send) (int sock, const char* data, size_t length);
+	// The core is done with a connection - stop serving it, drop its session and close it.
+	void (*disconnect) (int sock);
+	// Tell a connection the server is too busy, and when to try again (it is disconnected after).
+	void (*reject) (int sock, uint64_t retry_after_ms);
+	// Move a connection to a shared-memory channel (the "shm" request).
+	void (*attach_shm) (int sock);
+	// Take the size bytes that follow an "attach" request on sock, and deliver them to the
+	// recipients after the header line. Returns false if the transport can not take them.
+	bool (*receive_attachment) (int sock, const std::vector<int>& recipients, size_t size,
+	                            const std::string& header);
+	// Send frame to all the recipients in the background, and then ack to the sender (or tell it
+	// which recipients failed). The sender session is set waiting until then. Returns false to
+	// have the core send it inline. Optional.
+	bool (*fan_out) (int sender_sock, const std::vector<int>& recipients, const std::string& frame,
+	                 const std::string& ack);
+};
+
+// ---------------------------------------- Global variables ---------------------------------------
+
+extern transport_hooks client_transport; // Must be set before the first request is handled.
+
+extern groups_map groupsToClients; // Map of the groups and their clients.
+
+extern sockets_map clientsToSockets; // Map clients name to their file descriptor socket.
+
+extern sessions_map socketsToSessions; // Map every connected socket to its session.
+
+extern std::set<int> pendingSockets; // The connections with requests left for the next pass.
+
+extern history_map conversationsToHistory; // Map a conversation key to its recent messages.
+
+extern lru_list historyLru; // The conversation keys, the most recently used first.
+
+extern conversations_index clientsToConversations; // Map a client name to its direct conversation keys.
+
+extern departed_map departedClients; // The clients that left within the grace period.
+extern departure_list departures; // When they expire, the oldest first.
+
+extern size_t history_bytes; // The memory all the histories take.
+extern unsigned int history_msgs_cap;
+extern size_t history_bytes_cap;
+extern unsigned int history_grace_s; // 0 drops the direct conversations of a client when it leaves.
+
+extern unsigned int shed_lag_ms; // 0 turns the lag check off.
+extern unsigned int shed_queue; // 0 turns the queue check off.
+extern uint64_t loop_lag_us; // How long the last pass of the event loop took.
+extern unsigned int queue_depth; // The connections that had requests waiting at the start of the pass.
+extern unsigned long shed_clients; // Registrations rejected because of the load.
+
+extern unsigned int parallel_fanout_min; // 0 turns the background fan-out off.
+
+extern uint64_t request_id; // The id of the request being handled, for the probes.
+
+extern int trace_fd; // The capture file, -1 when capturing is off.
+extern struct timespec trace_start; // The time the capture started.
+extern uint32_t next_trace_id;
+
+// ------------------------------------ Function's declarations ------------------------------------
+
+int is_name_exist (std::string name);
+
+bool is_member (std::string client_name, std::string group_name);
+
+std::string get_sender_name (int sender_sock);
+
+bool trace_open (const char* path);
+
+void trace_event (const client_session* session, uint16_t type, const char* data, size_t length);
+
+void trace_flush ();
+
+void trace_flush_due (const struct timespec& now);
+
+void trace_close ();
+
+ssize_t send_to_client (int sock, const char* data, size_t length);
+
+void open_session (int sock, int transport);
+
+void close_session (int sock);
+
+void unregister_client (const std::string& client_name);
+
+void history_record (const std::string& key, const char* line, size_t length);
+
+void history_index (const std::string& key, bool add);
+
+void history_forget_client (const std::string& client_name);
+
+void history_expire_departed ();
+
+void add_new_client (int current_socket, std::string client_name);
+
+void server_who (int sender_sock);
+
+void server_exit (int sender_sock);
+
+void server_history (int sender_sock, std::string command);
+
+std::string send_failed_msg (const std::string& failed);
+
+void server_send (int sender_sock, std::string command);
+
+void server_create_group (int sender_sock, std::string command);
+
+void server_attach (int sender_sock, std::string command);
+
+void handle_client_request (char* req, int curr_sock);
+
+bool has_whole_request (const client_session* session);
+
+void serve_client_requests (int sock);
+
+void update_pending (int sock);
+
+#endif // WHATSAPP_CORE_H
@@ -0,0 +1,161 @@
+
+#ifndef WHATSAPP_LATENCY_H
+#define WHATSAPP_LATENCY_H
+
+// -------------------------------------------- Includes -------------------------------------------
+
+#include <string>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// The low-latency profile, shared by the server and the client. It trades CPU for tail latency:
+// small messages are sent at once (no Nagle), the kernel busy polls the device queue on reads, the
+// event loop spins for a while before it blocks in select, and it stays on one CPU.
+
+// -------------------------------------------- Defines --------------------------------------------
+
+#define LOW_LATENCY_OPT "--low-latency"
+#define SPIN_US_OPT "--spin-us" // How long the loop spins before it blocks.
+#define CPU_OPT "--cpu" // The CPU to pin the loop to.
+
+#define DEFAULT_SPIN_US 100
+#define BUSY_POLL_US 50 // SO_BUSY_POLL - raising it above net.core.busy_read needs CAP_NET_ADMIN.
+
+// --------------------------------------------- Types ---------------------------------------------
+
+/**
+ * The options of the low-latency profile. It is off unless LOW_LATENCY_OPT is given.
+ */
+struct latency_profile {
+	bool enabled;
+	unsigned int spin_us;
+	int cpu; // -1 - don't pin.
+};
+
+// ------------------------------------------- Functions -------------------------------------------
+
+/**
+ * The current time in nanoseconds.
+ */
+inline uint64_t latency_now_ns ()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Parse one of the profile options at argv[i] (and its value, i is moved past it). Giving SPIN_US_OPT
+ * or CPU_OPT turns the profile on too.
+ * @return false if argv[i] is not an option of the profile.
+ */
+inline bool latency_parse_option (latency_profile& profile, int argc, char *argv[], int& i)
+{
+	std::string option = argv[i];
+	if (option.compare(LOW_LATENCY_OPT) == 0){
+		profile.enabled = true;
+	}
+	else if (option.compare(SPIN_US_OPT) == 0 && i + 1 < argc){
+		profile.enabled = true;
+		profile.spin_us = (unsigned int) strtoul(argv[++i], NULL, 10);
+	}
+	else if (option.compare(CPU_OPT) == 0 && i + 1 < argc){
+		profile.enabled = true;
+		profile.cpu = atoi(argv[++i]);
+	}
+	else{
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Start the profile in the calling thread - pin it to the CPU of the profile. With a single CPU
+ * online the spinning is turned off: the peer we wait for can't run while we spin.
+ * @return false if the CPU can't be used.
+ */
+inline bool latency_apply (latency_profile& profile)
+{
+	if (profile.enabled && sysconf(_SC_NPROCESSORS_ONLN) < 2){
+		profile.spin_us = 0;
+	}
+	if (!profile.enabled || profile.cpu < 0){
+		return true;
+	}
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(profile.cpu, &cpus);
+	return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
+
+/**
+ * Set the socket options of the profile on a TCP socket - TCP_NODELAY and SO_BUSY_POLL.
+ * @return false if an option could not be set (errno tells why).
+ */
+inline bool latency_tune_socket (int sock, const latency_profile& profile)
+{
+	if (!profile.enabled){
+		return true;
+	}
+	int no_delay = 1;
+	int busy_poll = BUSY_POLL_US;
+	return setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay)) == 0 &&
+	       setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) == 0;
+}
+
+/**
+ * select() that spins with a zero timeout for the spin interval of the profile before it blocks.
+ * Without the profile, or when the caller does not want to block, it is a plain select().
+ */
+inline int latency_select (int nfds, fd_set* read_fds, fd_set* write_fds, struct timeval* timeout,
+                           const latency_profile& profile)
+{
+	if (!profile.enabled || profile.spin_us == 0 ||
+	    (timeout != NULL && timeout->tv_sec == 0 && timeout->tv_usec == 0)){
+		return select(nfds, read_fds, write_fds, NULL, timeout);
+	}
+	fd_set reads, writes;
+	FD_ZERO(&reads);
+	FD_ZERO(&writes);
+	if (read_fds != NULL){
+		reads = *read_fds;
+	}
+	if (write_fds != NULL){
+		writes = *write_fds;
+	}
+	uint64_t spin_end = latency_now_ns() + (uint64_t) profile.spin_us * 1000;
+	do {
+		struct timeval no_wait = {0, 0};
+		int ret_val = select(nfds, read_fds, write_fds, NULL, &no_wait);
+		if (ret_val != 0){
+			return ret_val;
+		}
+		if (read_fds != NULL){ // select cleared the sets - watch the same fds again.
+			*read_fds = reads;
+		}
+		if (write_fds != NULL){
+			*write_fds = writes;
+		}
+	} while (latency_now_ns() < spin_end);
+	return select(nfds, read_fds, write_fds, NULL, timeout);
+}
+
+/**
+ * Wait until fd is readable - spinning first, like latency_select.
+ */
+inline int latency_wait_readable (int fd, const latency_profile& profile)
+{
+	fd_set read_fds;
+	FD_ZERO(&read_fds);
+	FD_SET(fd, &read_fds);
+	return latency_select(fd + 1, &read_fds, NULL, NULL, profile);
+}
+
+#endif // WHATSAPP_LATENCY_H
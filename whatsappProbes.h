@@ -0,0 +1,61 @@
+#ifndef WHATSAPP_PROBES_H
+#define WHATSAPP_PROBES_H
+
+// -------------------------------------------- Includes -------------------------------------------
+
+// The probes are USDT (SystemTap / DTrace style) static tracepoints. With <sys/sdt.h> every probe is
+// a nop in the code plus a note in the binary, which bpftrace, perf and systemtap can attach to at
+// run time. Each probe has a semaphore that a tracer raises while it is attached, and the probe
+// tests it first - so its arguments are only computed when someone listens. Without <sys/sdt.h>
+// (the systemtap-sdt-dev package is not installed) the probes compile to nothing.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define WA_PROBES_ENABLED 1
+#endif
+#endif
+
+// -------------------------------------------- Defines --------------------------------------------
+
+// Every probe of the server - its semaphore is defined once, in whatsappCore.cpp.
+#define WA_PROBE_LIST(X) \
+	X(frame__received) X(command__parsed) X(request__done) \
+	X(send__entry) X(send__return) X(create_group__entry) X(create_group__return) \
+	X(who__entry) X(who__return) X(exit__entry) X(exit__return) \
+	X(fanout__start) X(fanout__done) X(socket__flush)
+
+#ifdef WA_PROBES_ENABLED
+#define WA_PROBE_SEMAPHORE(name) whatsapp_##name##_semaphore
+#define WA_DECLARE_SEMAPHORE(name) extern unsigned short WA_PROBE_SEMAPHORE(name);
+#define WA_DEFINE_SEMAPHORE(name) \
+	unsigned short WA_PROBE_SEMAPHORE(name) __attribute__((section(".probes")));
+WA_PROBE_LIST(WA_DECLARE_SEMAPHORE)
+
+// True while a tracer is attached to the probe - guard any other work done only for a probe.
+#define WA_PROBE_ENABLED(name) __builtin_expect(WA_PROBE_SEMAPHORE(name) != 0, 0)
+#define WA_PROBE1(name, a1) \
+	do { if (WA_PROBE_ENABLED(name)) DTRACE_PROBE1(whatsapp, name, a1); } while (0)
+#define WA_PROBE2(name, a1, a2) \
+	do { if (WA_PROBE_ENABLED(name)) DTRACE_PROBE2(whatsapp, name, a1, a2); } while (0)
+#define WA_PROBE3(name, a1, a2, a3) \
+	do { if (WA_PROBE_ENABLED(name)) DTRACE_PROBE3(whatsapp, name, a1, a2, a3); } while (0)
+#else
+#define WA_DEFINE_SEMAPHORE(name)
+#define WA_PROBE_ENABLED(name) false
+#define WA_PROBE1(name, a1) do {} while (0)
+#define WA_PROBE2(name, a1, a2) do {} while (0)
+#define WA_PROBE3(name, a1, a2, a3) do {} while (0)
+#endif
+
+// The probes of the server, in the order a request passes them (see whatsappProbes.bt):
+//   frame__received   (request id, socket, frame bytes)
+//   command__parsed   (request id, operation string)
+//   <handler>__entry  (request id, argument bytes)   for send, create_group, who and exit
+//   fanout__start     (request id, receivers)         a message to a group or a list of receivers
+//   fanout__done      (request id, delivered)
+//   socket__flush     (socket, bytes, result)         every message the server sends
+//   <handler>__return (request id)
+//   request__done     (request id)                   every request, whatever its command
+
+#endif // WHATSAPP_PROBES_H
@@ -0,0 +1,372 @@
+
+// -------------------------------------------- Includes -------------------------------------------
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include "whatsappTrace.h"
+#include "whatsappShm.h"
+
+// -------------------------------------------- Defines --------------------------------------------
+
+#define INVALID_ARG "Usage: whatsappReplay traceFile serverAddress serverPort [--fast]\n" \
+                    "       (serverAddress may also be unix:socketPath or shm:socketPath)\n"
+#define VALID_ARG_NUM 4
+#define FAST_OPT "--fast"
+
+#define RESPONSE_TIMEOUT_MS 2000
+#define RECV_BUFFER_SIZE 4096
+#define ERROR_PREFIX "ERROR:"
+#define PUSH_SEPARATOR ": "
+
+#define UNIX_PREFIX "unix:"
+#define SHM_PREFIX "shm:"
+
+// --------------------------------------------- Types ---------------------------------------------
+
+/**
+ * A record of the capture file together with its frame bytes.
+ */
+struct replay_record {
+	trace_record header;
+	std::string frame;
+};
+
+/**
+ * A connection to the server that replays one of the captured connections.
+ */
+struct replay_conn {
+	int sock;
+	bool is_shm;
+	shm_endpoint shm;
+	std::string pending; // Bytes received from the server that do not form a whole line yet.
+};
+
+// ---------------------------------------- Global variables ---------------------------------------
+
+std::map<uint32_t, replay_conn> conns; // Map captured connection ids to the replaying sockets.
+
+struct sockaddr_storage server_address;
+socklen_t server_address_len;
+bool use_shm = false;
+
+std::vector<double> latencies_us; // The response latency of every replayed frame.
+
+unsigned int timeouts = 0;
+
+// ------------------------------------------- Functions -------------------------------------------
+
+/**
+ * Return the current monotonic time in microseconds.
+ */
+uint64_t now_us ()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Read the whole capture file into memory.
+ * @param path the capture file path.
+ * @param records the vector to fill.
+ * @return true on success, false if the file can't be read or is not a capture file.
+ */
+bool load_trace (const char* path, std::vector<replay_record>& records)
+{
+	FILE* file = fopen(path, "rb");
+	if (file == NULL){
+		std::cout << "ERROR: fopen " << errno << "." << std::endl;
+		return false;
+	}
+	char magic[TRACE_MAGIC_LEN];
+	if (fread(magic, TRACE_MAGIC_LEN, 1, file) != 1 || memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN)){
+		std::cout << "ERROR: " << path << " is not a capture file." << std::endl;
+		fclose(file);
+		return false;
+	}
+	replay_record record;
+	while (fread(&record.header, sizeof(trace_record), 1, file) == 1){
+		record.frame.assign(record.header.length, '\0');
+		if (record.header.length > 0 &&
+		    fread(&record.frame[0], record.header.length, 1, file) != 1){
+			break; // A truncated record at the end of the capture.
+		}
+		records.push_back(record);
+	}
+	fclose(file);
+	return true;
+}
+
+/**
+ * A line is a response to our own request unless it looks like a message pushed by another client
+ * ("sender: message").
+ * @param line the line the server sent.
+ * @return true if the line is a response.
+ */
+bool is_response (const std::string& line)
+{
+	return line.compare(0, strlen(ERROR_PREFIX), ERROR_PREFIX) == 0 ||
+	       line.find(PUSH_SEPARATOR) == std::string::npos;
+}
+
+/**
+ * Read whatever the server sent on the connection and consume the whole lines.
+ * @param conn the connection.
+ * @return true if one of the consumed lines is a response, false otherwise.
+ */
+bool drain_conn (replay_conn& conn)
+{
+	char buf[RECV_BUFFER_SIZE];
+	ssize_t br;
+	if (conn.is_shm){
+		shm_clear_doorbell(conn.shm.in_fd);
+		br = shm_ring_read(conn.shm.in, buf, sizeof(buf));
+	}
+	else{
+		br = recv(conn.sock, buf, sizeof(buf), MSG_DONTWAIT);
+	}
+	if (br <= 0){
+		return false;
+	}
+	conn.pending.append(buf, br);
+
+	bool got_response = false;
+	size_t end;
+	while ((end = conn.pending.find('\n')) != std::string::npos){
+		if (is_response(conn.pending.substr(0, end))){
+			got_response = true;
+		}
+		conn.pending.erase(0, end + 1);
+	}
+	return got_response;
+}
+
+/**
+ * Wait until the server responds on the given connection. Pushes that arrive meanwhile on any
+ * connection are read and dropped, so the server never blocks on a full socket.
+ * @param conn_id the connection that waits for a response.
+ * @return true if a response arrived, false on timeout.
+ */
+bool wait_for_response (uint32_t conn_id)
+{
+	uint64_t deadline = now_us() + RESPONSE_TIMEOUT_MS * 1000;
+	std::vector<struct pollfd> pfds;
+	std::vector<uint32_t> ids;
+	for (std::map<uint32_t, replay_conn>::iterator it = conns.begin(); it != conns.end(); ++it){
+		struct pollfd pfd;
+		pfd.fd = it->second.is_shm ? it->second.shm.in_fd : it->second.sock;
+		pfd.events = POLLIN;
+		pfds.push_back(pfd);
+		ids.push_back(it->first);
+	}
+
+	while (now_us() < deadline){
+		// A shm ring may still hold lines from a previous drain that stopped at our response.
+		for (unsigned int i = 0; i < ids.size(); i ++){
+			replay_conn& conn = conns[ids[i]];
+			if (conn.is_shm && !shm_ring_empty(conn.shm.in) && drain_conn(conn) && ids[i] == conn_id){
+				return true;
+			}
+		}
+		int timeout_ms = (int) ((deadline - now_us()) / 1000) + 1;
+		if (poll(&pfds[0], pfds.size(), timeout_ms) < 0){
+			std::cout << "ERROR: poll " << errno << "." << std::endl;
+			return false;
+		}
+		for (unsigned int i = 0; i < pfds.size(); i ++){
+			if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)){
+				if (drain_conn(conns[ids[i]]) && ids[i] == conn_id){
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+/**
+ * Open a new connection to the server for a captured connection.
+ * @param conn_id the captured connection id.
+ */
+void replay_open (uint32_t conn_id)
+{
+	replay_conn conn;
+	conn.is_shm = use_shm;
+	if ((conn.sock = socket(server_address.ss_family, SOCK_STREAM, 0)) < 0) {
+		std::cout << "ERROR: socket " << errno << "." << std::endl;
+		exit(1);
+	}
+	if (connect(conn.sock, (struct sockaddr *)&server_address, server_address_len) < 0) {
+		std::cout << "ERROR: connect " << errno << "." << std::endl;
+		exit(1);
+	}
+	if (use_shm && !shm_attach(conn.sock, conn.shm)){
+		std::cout << "ERROR: shm attach " << errno << "." << std::endl;
+		exit(1);
+	}
+	conns[conn_id] = conn;
+}
+
+/**
+ * Send a captured frame and measure how long the server takes to respond to it.
+ * @param record the frame record.
+ */
+void replay_frame (const replay_record& record)
+{
+	std::map<uint32_t, replay_conn>::iterator it = conns.find(record.header.conn_id);
+	if (it == conns.end()){ // The connection was opened before the capture started.
+		replay_open(record.header.conn_id);
+		it = conns.find(record.header.conn_id);
+	}
+	uint64_t start = now_us();
+	ssize_t sent = it->second.is_shm ?
+	               shm_send(it->second.shm, record.frame.c_str(), record.frame.length()) :
+	               send(it->second.sock, record.frame.c_str(), record.frame.length(), 0);
+	if (sent < 0) {
+		std::cout << "ERROR: send " << errno << "." << std::endl;
+		return;
+	}
+	if (wait_for_response(record.header.conn_id)){
+		latencies_us.push_back((double) (now_us() - start));
+	}
+	else{
+		timeouts++;
+	}
+}
+
+/**
+ * Close the connection of a captured connection that was closed.
+ * @param conn_id the captured connection id.
+ */
+void replay_close (uint32_t conn_id)
+{
+	std::map<uint32_t, replay_conn>::iterator it = conns.find(conn_id);
+	if (it != conns.end()){
+		if (it->second.is_shm){
+			shm_close(it->second.shm);
+		}
+		close(it->second.sock);
+		conns.erase(it);
+	}
+}
+
+/**
+ * Return the given percentile of the sorted latencies.
+ */
+double percentile (const std::vector<double>& sorted, double p)
+{
+	if (sorted.empty()){
+		return 0;
+	}
+	size_t index = (size_t) (p / 100.0 * (sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
+
+/**
+ * Print the throughput and the latency distribution of the replay.
+ * @param elapsed_us the wall time of the whole replay.
+ */
+void print_report (uint64_t elapsed_us)
+{
+	std::vector<double> sorted = latencies_us;
+	std::sort(sorted.begin(), sorted.end());
+	double seconds = elapsed_us / 1000000.0;
+
+	std::cout << "frames " << sorted.size() << std::endl;
+	std::cout << "timeouts " << timeouts << std::endl;
+	std::cout << "elapsed_s " << seconds << std::endl;
+	std::cout << "throughput_fps " << (seconds > 0 ? sorted.size() / seconds : 0) << std::endl;
+	std::cout << "latency_us_p50 " << percentile(sorted, 50) << std::endl;
+	std::cout << "latency_us_p90 " << percentile(sorted, 90) << std::endl;
+	std::cout << "latency_us_p99 " << percentile(sorted, 99) << std::endl;
+	std::cout << "latency_us_p999 " << percentile(sorted, 99.9) << std::endl;
+	std::cout << "latency_us_max " << (sorted.empty() ? 0 : sorted.back()) << std::endl;
+}
+
+/**
+ * The main function - replay a capture file against a fresh server and report its performance.
+ * @param argc the number of arguments.
+ * @param argv the arguments of the program (capture file, server address, port, --fast).
+ * @return 0 on success.
+ */
+int main (int argc, char *argv[])
+{
+	bool fast = argc == VALID_ARG_NUM + 1 && std::string(argv[VALID_ARG_NUM]).compare(FAST_OPT) == 0;
+	if (argc != VALID_ARG_NUM && !fast) {
+		std::cout << INVALID_ARG;
+		return 1;
+	}
+
+	std::vector<replay_record> records;
+	if (!load_trace(argv[1], records)){
+		return 1;
+	}
+
+	std::string address = argv[2];
+	memset(&server_address, 0, sizeof(server_address));
+	if (address.compare(0, strlen(UNIX_PREFIX), UNIX_PREFIX) == 0 ||
+	    address.compare(0, strlen(SHM_PREFIX), SHM_PREFIX) == 0){
+		use_shm = address[0] == 's';
+		std::string path = address.substr(address.find(":") + 1);
+		struct sockaddr_un* unix_address = (struct sockaddr_un*) &server_address;
+		unix_address->sun_family = AF_UNIX;
+		strncpy(unix_address->sun_path, path.c_str(), sizeof(unix_address->sun_path) - 1);
+		server_address_len = sizeof(struct sockaddr_un);
+	}
+	else{
+		struct hostent* host;
+		if ((host = gethostbyname(argv[2])) == NULL){
+			std::cout << "ERROR: gethostbyname " << errno << "." << std::endl;
+			return 1;
+		}
+		struct sockaddr_in* inet_address = (struct sockaddr_in*) &server_address;
+		inet_address->sin_family = host->h_addrtype;
+		memcpy(&inet_address->sin_addr, host->h_addr, host->h_length);
+		inet_address->sin_port = htons(atoi(argv[3]));
+		server_address_len = sizeof(struct sockaddr_in);
+	}
+
+	uint64_t start = now_us();
+	for (unsigned int i = 0; i < records.size(); i ++){
+		const replay_record& record = records[i];
+		if (!fast){ // Keep the original timing of the capture.
+			uint64_t due = start + record.header.timestamp_us;
+			uint64_t now = now_us();
+			if (due > now){
+				usleep(due - now);
+			}
+		}
+		switch (record.header.type){
+			case TRACE_OPEN:
+				replay_open(record.header.conn_id);
+				break;
+			case TRACE_FRAME:
+				replay_frame(record);
+				break;
+			case TRACE_CLOSE:
+				replay_close(record.header.conn_id);
+				break;
+			default:
+				break;
+		}
+	}
+	print_report(now_us() - start);
+
+	while (!conns.empty()){
+		replay_close(conns.begin()->first);
+	}
+	return 0;
+}
@@ -3,7 +3,6 @@
 
 #include <map>
 #include <iostream>
-#include <set>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <stdlib.h>
@@ -13,329 +12,795 @@
 #include <vector>
 #include <algorithm>
 #include <netdb.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <time.h>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include "whatsappCore.h"
+#include "whatsappTrace.h"
+#include "whatsappShm.h"
+#include "whatsappLatency.h"
+#include "whatsappProbes.h"
 
 // -------------------------------------------- Defines --------------------------------------------
 
-#define INVALID_ARG_MSG "Usage: whatsappServer portNum\n"
+#define INVALID_ARG_MSG "Usage: whatsappServer portNum [--capture traceFile] [--unix socketPath]" \
+                        " [--history-msgs num] [--history-bytes num] [--history-grace-s num]" \
+                        " [--backlog num]" \
+                        " [--max-connections num] [--shed-lag-ms num] [--shed-queue num]" \
+                        " [--low-latency] [--spin-us num] [--cpu num]" \
+                        " [--fanout-threads num] [--fanout-min num]\n"
+#define UPGRADE_ERR_MSG "ERROR: hot restart failed, the server keeps running."
 #define EXIT_SERVER_MSG "EXIT command is typed: server is shutting down"
-#define CATCH_NAME "Client name is already in use.\n"
-
-#define CREATE_GRP_ERR "ERROR: failed to create group \""
-#define WHO_MSG ": Requests the currently connected client names.\n"
-#define SEND_SUCCESS_MSG "Sent successfully.\n"
-#define SEND_ERR_MSG "ERROR: failed to send.\n"
-#define EXIT_CLIENT_MSG "Unregistered successfully."
-
-#define CONNECTED " connected"
-#define CON_FAIL "Failed to connect the server"
-#define CON_SUCCEED "Connected Successfully.\n"
+#define SERVER_BUSY "Server is busy, retry after " // Followed by the retry hint in ms.
+#define ATTACH_SENT_MSG "Sent successfully.\n"
 
 #define VALID_ARG_NUM 2
-#define MAX_PENDING_SOCKETS 10
 
-#define NOT_EXIST 0
-#define IS_CLIENT_NAME 1
-#define IS_GROUP_NAME 2
-
-#define MAX_MSG_LEN 256
+#define CAPTURE_OPT "--capture"
+#define UNIX_OPT "--unix"
+#define HISTORY_MSGS_OPT "--history-msgs"
+#define HISTORY_BYTES_OPT "--history-bytes"
+#define HISTORY_GRACE_OPT "--history-grace-s"
+#define BACKLOG_OPT "--backlog"
+#define MAX_CONNECTIONS_OPT "--max-connections"
+#define SHED_LAG_OPT "--shed-lag-ms"
+#define SHED_QUEUE_OPT "--shed-queue"
+#define FANOUT_THREADS_OPT "--fanout-threads"
+#define FANOUT_MIN_OPT "--fanout-min"
+#define INHERIT_OPT "--inherit" // Internal - the new binary of a hot restart gets its state here.
+#define SNAPSHOT_MAGIC 0x57415353 // "WASS"
+#define SELF_EXE "/proc/self/exe"
+#define MAX_FDS_PER_MSG 250 // Stay below the kernel limit of fds in one SCM_RIGHTS message.
+#define MAX_HANDOFF_FDS (4 * FD_SETSIZE) // A shm session passes 4 fds.
+#define DEFAULT_BACKLOG 1024 // The kernel caps it with net.core.somaxconn.
+#define DEFAULT_MAX_CONNECTIONS 1000 // select() cannot watch fds above FD_SETSIZE (1024).
+
+#define READ_BUDGET_BYTES 4096 // The bytes a connection may hand us in one pass of the event loop.
+#define ATTACH_BUDGET_BYTES 65536 // The attachment bytes one connection may move in one pass.
+#define OUTBUF_MAX (1 << 20) // The output that may be queued for a client that does not read.
+#define MAX_DEFERRED_BYTES (1 << 20) // The messages that may wait for the deliveries of a receiver.
+#define MAX_SPOOLED_BYTES (4 * (size_t) MAX_ATTACHMENT_SIZE) // All the attachments in flight.
+#define SHM_FLUSH_US 1000 // How often the loop retries queued shm output (the ring has no event).
+#define FANOUT_TASK_SIZE 64 // The receivers of one task of a background fan-out.
+#define MAX_FANOUT_THREADS 8
+#define FANOUT_SENT 0
+#define FANOUT_QUEUED 1
+#define FANOUT_FAILED 2
 #define MAX_HOST_NAME_LEN 30
 
-#define NAME "name"
-#define CREATE_GROUP "create_group"
-#define SEND "send"
-#define WHO "who"
-#define EXIT "exit"
-
 #define EXIT_SERVER "EXIT"
-
-#define END_LINE "\n"
-
+#define STATS_SERVER "STATS"
+#define UPGRADE_SERVER "UPGRADE"
 
 // ---------------------------------------- Global variables ---------------------------------------
 
-std::map<std::string, std::set<std::string>> groupsToClients; // Map of the groups and their clients.
+std::map<int, int> doorbellsToSockets; // Map the doorbell of every shm session to its socket.
 
-std::map<std::string, int> clientsToSockets; // Map clients name to their file descriptor socket.
-
-std::vector<int> fds; // A vector contains all the sockets that connect to the server.
+std::vector<int> fds; // A vector contains all the sockets (and doorbells) the server listens to.
 
 int welcome_socket,
 	fd_max;
 
+int unix_socket = -1; // The unix domain listener, -1 when it is off.
+std::string unix_path;
+
+int inherit_fd = -1; // The socket the snapshot of a hot restart arrives on, -1 on a normal start.
+std::vector<std::string> server_args; // The arguments to start the new binary with on a hot restart.
+std::string server_binary; // The absolute path this server was started from.
+
+int listen_backlog = DEFAULT_BACKLOG;
+unsigned int max_connections = DEFAULT_MAX_CONNECTIONS;
+unsigned long refused_connections = 0; // Connections rejected because of max-connections.
+
+latency_profile server_latency = {false, DEFAULT_SPIN_US, -1};
+
 fd_set clients_fds;
 fd_set read_fds;
+fd_set write_fds;
+
+int stop_doorbell = -1; // Rung by the SIGINT and SIGTERM handler - the loop then shuts the server down.
+volatile sig_atomic_t stop_signal = 0;
+
+std::vector<int> work_fds; // The connections to serve in this pass of the event loop.
+fd_set work_set; // The same connections, to add each one once.
+
+/**
+ * An attachment, spooled to a memory file. While it is received its bytes move from the sender
+ * socket through a pipe to the file with splice, without a copy to user space. Then every receiver
+ * gets it from the file with sendfile (or from the file mapping, on a shm ring).
+ */
+struct attachment_spool {
+	int memfd;
+	int pipe_fds[2]; // Closed (-1) once all the bytes were received.
+	size_t size;
+	size_t received;
+	std::vector<std::pair<int, uint32_t>> recipients; // The socket and the trace id of every receiver.
+	std::string header; // The line the receivers get before the bytes.
+	char* map; // The file mapping, for the receivers on a shm ring.
+	unsigned int refs; // The deliveries that did not end yet.
+};
+
+/**
+ * The delivery of a spooled attachment to one receiver.
+ */
+struct attachment_delivery {
+	attachment_spool* spool;
+	size_t offset; // The bytes the receiver already got.
+	bool header_sent;
+};
+
+std::map<int, attachment_spool*> socketsToUploads; // Map a sender socket to the attachment it sends.
+
+std::map<int, std::list<attachment_delivery>> socketsToDeliveries; // The attachments every receiver
+                                                                   // gets, one after the other.
+
+std::map<int, std::string> socketsToDeferred; // Messages that wait for the deliveries of a receiver.
+std::set<int> backlogSockets; // The sessions with queued output in their outbuf.
+size_t spooled_bytes = 0; // The size of all the spooled attachments.
+
+/**
+ * A receiver of a background fan-out. The session may be used only under the socket lock, and only
+ * while socket_owner still is owner.
+ */
+struct fanout_recipient {
+	int sock;
+	uint32_t owner;
+	client_session* session;
+	std::string name;
+};
+
+/**
+ * A group message that is sent by the fan-out workers. It is split into tasks of FANOUT_TASK_SIZE
+ * receivers, and the worker that ends the last task hands it back to the loop.
+ */
+struct fanout_job {
+	int sender_sock;
+	uint32_t sender_owner; // The socket_owner of the sender when the job started.
+	std::string sender;
+	uint64_t request_id;
+	std::vector<fanout_recipient> recipients;
+	std::vector<char> outcome; // FANOUT_SENT, FANOUT_QUEUED or FANOUT_FAILED, per receiver.
+	std::string frame;
+	std::string ack;
+	std::string failed; // The receivers the loop could not send to, comma separated.
+	std::atomic<size_t> tasks_left;
+	size_t shm_delivered; // The receivers on a shm ring, sent to by the loop.
+};
+
+/**
+ * A range of the receivers of a job.
+ */
+struct fanout_task {
+	fanout_job* job;
+	size_t begin;
+	size_t end;
+};
+
+/**
+ * The tasks of one worker. The worker takes the newest task of its own, and when it has none it
+ * steals the oldest task of another worker.
+ */
+struct fanout_worker {
+	std::mutex lock;
+	std::deque<fanout_task> tasks;
+};
+
+/**
+ * The fan-out workers and what they share with the loop. It is never freed, so it outlives the
+ * workers when the process exits.
+ */
+struct fanout_pool {
+	std::vector<fanout_worker*> workers;
+	unsigned int next_worker; // The worker that gets the next task.
+	std::mutex idle_lock;
+	std::condition_variable wakeup;
+	long queued; // The tasks in all the workers (under idle_lock), never less than there are.
+	std::mutex done_lock;
+	std::vector<fanout_job*> done; // The jobs that ended, for the loop.
+	int doorbell; // An eventfd the workers ring when they add to done.
+};
+
+fanout_pool* pool = NULL; // NULL when the background fan-out is off.
+unsigned int fanout_threads = 0;
+unsigned int fanouts_in_flight = 0; // While it is not 0, the sockets are shared with the workers.
+unsigned long background_fanouts = 0;
+
+// A worker sends to a socket only under its lock, and only if the socket still belongs to the
+// connection it belonged to when the job started (fds are reused). It never waits for the socket:
+// what does not fit goes to the session outbuf, for the loop to flush. The loop takes the lock to
+// drop a session, and to send to one (or flush it) while there are jobs in flight.
+std::mutex socket_locks[FD_SETSIZE];
+uint32_t socket_owner[FD_SETSIZE]; // The trace id + 1 of the session on the socket, 0 if none.
 
 
 // ------------------------------------ Function's declarations ------------------------------------
 
-void add_new_client (int current_socket, std::string name);
+void hot_restart ();
+
+void finish_fanouts ();
+
+void remove_client_socket (int sock);
 
 // ------------------------------------------- Functions -------------------------------------------
 
 /**
- * The function recieve a client name and check if it is already exists as a client name or a
- * group name.
- * @param client_name the client name.
- * @return 0 - not exist, 1 - exist as client, 2 - exist as group.
+ * Send bytes to a client over the transport of its session - its socket, or the shared-memory ring
+ * of a TRANSPORT_SHM session. The loop never waits for a client: what does not fit is queued in
+ * the session outbuf, behind what is already there, and flushed by the loop when there is room.
+ * Past OUTBUF_MAX of queued bytes, more are refused.
+ * @return the number of bytes sent (or queued), or -1 on error (like send()).
  */
-int is_name_exist (std::string name)
+ssize_t send_now (int sock, const char* data, size_t length)
 {
-	if (groupsToClients.find(name) != groupsToClients.end()){
-		return IS_GROUP_NAME;
+	sessions_map::iterator it = socketsToSessions.find(sock);
+	if (it == socketsToSessions.end()){
+		return send(sock, data, length, MSG_NOSIGNAL);
 	}
-	if(clientsToSockets.find(name) != clientsToSockets.end())
-	{
-		return IS_CLIENT_NAME;
+	client_session* session = it->second;
+	std::unique_lock<std::mutex> guard(socket_locks[sock], std::defer_lock);
+	if (fanouts_in_flight > 0){ // A worker may be queueing to the same client.
+		guard.lock();
 	}
-	return NOT_EXIST;
+	if (session->outbuf.length() + length > OUTBUF_MAX){
+		errno = ENOBUFS;
+		return -1;
+	}
+	size_t sent = 0;
+	if (session->outbuf.empty()){
+		ssize_t written = session->transport == TRANSPORT_SHM ?
+		                  shm_try_send(session->shm, data, length) :
+		                  send(sock, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (written < 0 && (session->transport == TRANSPORT_SHM || errno != EAGAIN)){
+			return -1;
+		}
+		sent = std::max(written, (ssize_t) 0);
+	}
+	if (sent < length){
+		session->outbuf.append(data + sent, length - sent);
+		backlogSockets.insert(sock);
+	}
+	return (ssize_t) length;
 }
 
 /**
- * This function check if the client is a member in the group members of the given group name.
- * @param client_name
- * @param group_name
- * @return true if client_name is a member in group_name o.w false
+ * Move the queued output of a session to its socket or ring, as far as the client made room.
+ * A client we can no longer write to is disconnected.
+ * @param session the session.
+ * @return false if the client was disconnected (its session is gone).
  */
-bool is_member(std::string client_name, std::string group_name){
-	std::map<std::string, std::set<std::string>>::iterator it = groupsToClients.find(group_name);
-
-	if (it != groupsToClients.end()){ // The group is exist
-		std::set<std::string> set = it->second;
-		return set.find(client_name) != set.end();
+bool flush_output (client_session* session)
+{
+	int sock = session->sock;
+	ssize_t written;
+	{
+		std::unique_lock<std::mutex> guard(socket_locks[sock], std::defer_lock);
+		if (fanouts_in_flight > 0){
+			guard.lock();
+		}
+		if (session->transport == TRANSPORT_SHM){
+			written = shm_try_send(session->shm, session->outbuf.data(), session->outbuf.length());
+		}
+		else{
+			written = send(sock, session->outbuf.data(), session->outbuf.length(),
+			               MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (written < 0 && errno == EAGAIN){
+				written = 0;
+			}
+		}
+		if (written > 0){
+			session->outbuf.erase(0, written);
+		}
+		if (session->outbuf.empty()){
+			backlogSockets.erase(sock);
+		}
 	}
+	if (written >= 0){
+		return true;
+	}
+	std::cout << "ERROR: " << session->name << " can not get its messages (" << errno
+	          << "), disconnecting." << std::endl;
+	unregister_client(session->name);
+	remove_client_socket(sock);
 	return false;
-//	return groupsToClients[group_name].find(client_name) != groupsToClients[client_name].end();
 }
 
 /**
- * Return the client name that cooresponde to the sender_sock.
- * @param sender_sock the sender socket.
- * @return the cooresponde client name.
+ * Check if some session has output that waits for room in its socket or ring.
+ */
+bool has_output_backlog ()
+{
+	return !backlogSockets.empty();
+}
+
+/**
+ * Mark a socket as the one of the given session, for the fan-out workers.
+ */
+void claim_socket (int sock, const client_session* session)
+{
+	std::lock_guard<std::mutex> guard(socket_locks[sock]);
+	socket_owner[sock] = session->trace_id + 1;
+}
+
+/**
+ * Send a message to a client. While the client gets an attachment the message waits for the end
+ * of the delivery, so it does not land in the middle of the attachment bytes. Past
+ * MAX_DEFERRED_BYTES of waiting messages, more are refused.
+ * @param sock the client socket.
+ * @param data the message.
+ * @param length the message length.
+ * @return the number of bytes sent (or deferred), or -1 on error (like send()).
  */
-std::string get_sender_name (int sender_sock){
-	for (std::map<std::string, int>::iterator it = clientsToSockets.begin();
-	     it != clientsToSockets.end(); ++it){
-		if (sender_sock == (*it).second){
-			return (*it).first;
+ssize_t socket_send (int sock, const char* data, size_t length)
+{
+	if (socketsToDeliveries.count(sock)){
+		std::string& deferred = socketsToDeferred[sock];
+		if (deferred.length() + length > MAX_DEFERRED_BYTES){
+			errno = ENOBUFS;
+			return -1;
 		}
+		deferred.append(data, length);
+		return (ssize_t) length;
 	}
-	return "";
+	return send_now(sock, data, length);
 }
 
 /**
- * This function take care to operate the "who" request.
- * @param sender_sock the client file descriptor.
+ * Add a file descriptor to the ones the event loop listens to.
+ * @param fd the file descriptor.
  */
-void server_who(int sender_sock){
-	std::string sender_name = get_sender_name(sender_sock);
-	std::cout << sender_name << WHO_MSG;
-	std::string response = "";
-	for(std::map<std::string, int>::iterator it = clientsToSockets.begin();
-	    it != clientsToSockets.end(); ++it){
-		response += (*it).first;
-		response += ",";
-	}
-	response = response.substr(0, response.length() - 1) + END_LINE;
-	if (send(clientsToSockets[sender_name], response.c_str(), response.length(), 0) < 0) {
-		std::cout << "ERROR: send " << errno << "." << std::endl;
+void listen_to_fd (int fd)
+{
+	if (fd > fd_max - 1){ // Update the max file descriptor.
+		fd_max = fd + 1;
 	}
+	fds.push_back(fd);
+	FD_SET(fd, &clients_fds);
 }
 
 /**
- * This function take care to operate the "exit" request.
- * @param sender_sock the client file descriptor.
+ * Stop listening to a file descriptor.
+ * @param fd the file descriptor.
  */
-void server_exit(int sender_sock){
-	std::string client_to_remove = get_sender_name(sender_sock);
-	for(std::map<std::string, std::set<std::string>>::iterator map_iter = groupsToClients.begin();
-		map_iter != groupsToClients.end(); ++map_iter)
-	{
-		for(std::set<std::string>::iterator it = (*map_iter).second.begin(); it != (*map_iter).second.end(); ++it)
-		{
-			if((*it).compare(client_to_remove) == 0){
-				(*map_iter).second.erase(*it);
-				break;
-			}
+void stop_listening_to_fd (int fd)
+{
+	FD_CLR(fd, &clients_fds);
+	std::vector<int>::iterator it = std::find(fds.begin(), fds.end(), fd);
+	if (it != fds.end()){
+		fds.erase(it);
+	}
+}
+
+/**
+ * Free a spooled attachment when no delivery uses it any more.
+ */
+void release_spool (attachment_spool* spool)
+{
+	if (spool->refs > 0 && --spool->refs > 0){
+		return;
+	}
+	for (int i = 0; i < 2; i ++){
+		if (spool->pipe_fds[i] >= 0){
+			close(spool->pipe_fds[i]);
+		}
+	}
+	if (spool->map != NULL){
+		munmap(spool->map, spool->size);
+	}
+	close(spool->memfd);
+	spooled_bytes -= spool->size;
+	delete spool;
+}
+
+/**
+ * Drop the attachment a client sends and the ones it gets (it is disconnected).
+ * @param sock the client socket.
+ */
+void drop_attachments (int sock)
+{
+	std::map<int, attachment_spool*>::iterator upload = socketsToUploads.find(sock);
+	if (upload != socketsToUploads.end()){
+		release_spool(upload->second);
+		socketsToUploads.erase(upload);
+	}
+	std::map<int, std::list<attachment_delivery>>::iterator deliveries = socketsToDeliveries.find(sock);
+	if (deliveries != socketsToDeliveries.end()){
+		for (std::list<attachment_delivery>::iterator it = deliveries->second.begin();
+		     it != deliveries->second.end(); ++it){
+			release_spool(it->spool);
 		}
+		socketsToDeliveries.erase(deliveries);
+	}
+	socketsToDeferred.erase(sock);
+}
+
+/**
+ * Stop listening to the given socket, drop its session and close it.
+ * @param sock the socket to remove.
+ */
+void remove_client_socket (int sock)
+{
+	stop_listening_to_fd(sock);
+	drop_attachments(sock);
+	sessions_map::iterator it = socketsToSessions.find(sock);
+	if (it != socketsToSessions.end() && it->second->transport == TRANSPORT_SHM){
+		stop_listening_to_fd(it->second->shm.in_fd);
+		doorbellsToSockets.erase(it->second->shm.in_fd);
+		shm_close(it->second->shm);
+		close(it->second->shm_memfd);
 	}
-	clientsToSockets.erase(client_to_remove);
-	std::vector<int>::iterator elem = std::find(fds.begin(), fds.end(), sender_sock);
-	fds.erase(elem);
-	FD_CLR(sender_sock, &clients_fds);
+	{ // From now on no worker touches the session.
+		std::lock_guard<std::mutex> guard(socket_locks[sock]);
+		socket_owner[sock] = 0;
+	}
+	if (it != socketsToSessions.end() && it->second->transport != TRANSPORT_SHM &&
+	    !it->second->outbuf.empty()){ // Its last words (the exit reply), if they fit.
+		send(sock, it->second->outbuf.data(), it->second->outbuf.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	backlogSockets.erase(sock);
+	close_session(sock);
+	close(sock);
+}
 
-	std::string response = EXIT_CLIENT_MSG;
-	response += "\n";
-	if (send(sender_sock, response.c_str(), response.length(), 0) < 0) {
+/**
+ * Tell a client that asked for a shared-memory channel that it does not get one. The client waits
+ * for the answer, and then goes on over its socket.
+ * @param sock the client socket.
+ */
+void refuse_shm_attach (int sock)
+{
+	if (send_to_client(sock, SHM_ATTACH_REFUSED, strlen(SHM_ATTACH_REFUSED)) < 0){
 		std::cout << "ERROR: send " << errno << "." << std::endl;
 	}
-	std::cout << client_to_remove << ": " << EXIT_CLIENT_MSG << std::endl;
 }
 
 /**
- * This function take care to operate the "send" request.
+ * This function take care to operate the "shm" request - it moves a client that is connected over
+ * the unix domain socket to a shared-memory channel. The channel memory and its two doorbells are
+ * passed to the client over the socket, which stays open only to notice when the client is gone.
+ * If the channel can't be set up the client is refused, and stays on its socket.
  * @param sender_sock the client file descriptor.
- * @param command the details of the message - who receive the message and what is the message.
  */
-void server_send(int sender_sock, std::string command){
-	std::string sender = get_sender_name(sender_sock);
-	std::string receiver = command.substr(0, command.find(" "));
-	std::string msg = command.substr(command.find(" ") + 1);
-	std::string client_msg = "";
+void server_shm_attach (int sender_sock)
+{
+	client_session* session = socketsToSessions[sender_sock];
+	if (session->transport != TRANSPORT_UNIX){
+		std::cout << "ERROR: shm is only supported over the unix domain socket." << std::endl;
+		refuse_shm_attach(sender_sock);
+		return;
+	}
 
-	switch (is_name_exist(receiver)){
-		case(IS_CLIENT_NAME):
-		{
-			std::string receiver_msg = sender + ": " + msg + END_LINE;
-			// Send the message to the receiver
-			if (send(clientsToSockets[receiver], receiver_msg.c_str(), receiver_msg.length(), 0) < 0) {
-				std::cout << "ERROR: send " << errno << "." << std::endl;
-				return;
-			}
-			std::cout << sender + ": \"" + command.substr(command.find(" ") + 1)
-			             + "\" was sent successfully to " + receiver + "." << std::endl;
+	int shm_fds[SHM_FDS_NUM];
+	if ((shm_fds[0] = memfd_create("whatsapp-shm", MFD_CLOEXEC)) < 0){
+		std::cout << "ERROR: memfd_create " << errno << "." << std::endl;
+		refuse_shm_attach(sender_sock);
+		return;
+	}
+	if (ftruncate(shm_fds[0], sizeof(shm_channel)) < 0 || !shm_map(session->shm, shm_fds[0], true)){
+		std::cout << "ERROR: mmap " << errno << "." << std::endl;
+		close(shm_fds[0]);
+		refuse_shm_attach(sender_sock);
+		return;
+	}
+	shm_fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); // Client -> server doorbell.
+	shm_fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); // Server -> client doorbell.
+	session->shm.in_fd = shm_fds[1];
+	session->shm.out_fd = shm_fds[2];
+	if (shm_fds[1] < 0 || shm_fds[2] < 0 || shm_fds[1] >= FD_SETSIZE || shm_fds[2] >= FD_SETSIZE ||
+	    !shm_send_fds(sender_sock, shm_fds, SHM_ATTACH_REQUEST)){
+		std::cout << "ERROR: shm attach " << errno << "." << std::endl;
+		close(shm_fds[0]);
+		shm_close(session->shm);
+		refuse_shm_attach(sender_sock);
+		return;
+	}
+	session->shm_memfd = shm_fds[0];
+	session->transport = TRANSPORT_SHM;
+	doorbellsToSockets[session->shm.in_fd] = sender_sock;
+	listen_to_fd(session->shm.in_fd);
+}
 
-			client_msg = SEND_SUCCESS_MSG;
-			// Success message to the sender.
-			if (send(sender_sock, client_msg.c_str(), client_msg.length(), 0) < 0) {
-				std::cout << "ERROR: send " << errno << "." << std::endl;
-				return;
-			}
-			break;
-		}
-		case(IS_GROUP_NAME): // receiver = group name
-		{
-			if(!is_member(sender, receiver)){
-				std::cout << sender + ": ERROR: failed to send \"" + msg + "\" to " + receiver +
-						"." << std::endl;
-				std::string error_msg = SEND_ERR_MSG;
-				if (send(sender_sock, error_msg.c_str(), error_msg.length(), 0) < 0) {
-					std::cout << "ERROR: send " << errno << "." << std::endl;
-					return;
-				}
-				break;
-			}
-			std::string receiver_msg = sender + ": " + msg + END_LINE;
-			// Send message to all group members.
-			for(std::set<std::string>::iterator it = groupsToClients[receiver].begin();
-			    it != groupsToClients[receiver].end(); ++it)
-			{
-				// If the current client is the sender don't send him the message.
-				if ((*it).compare(sender) != 0){
-					if (send(clientsToSockets[*it], receiver_msg.c_str(), receiver_msg.length(), 0) < 0) {
-						std::cout << "ERROR: send " << errno << "." << std::endl;
-						return;
-					}
-				}
-			}
+/**
+ * Take the attachment that follows an "attach" request - open its spool, and move into it the
+ * bytes that were already read with the request. The rest is moved by pump_upload.
+ * @param sender_sock the sender socket.
+ * @param recipients the sockets of the receivers.
+ * @param size the attachment size.
+ * @param header the line the receivers get before the bytes.
+ * @return false if the attachment can not be taken.
+ */
+bool server_receive_attachment (int sender_sock, const std::vector<int>& recipients, size_t size,
+                                const std::string& header)
+{
+	client_session* session = socketsToSessions[sender_sock];
+	if (session->transport == TRANSPORT_SHM){
+		std::cout << "ERROR: attachments are not supported over shm." << std::endl;
+		return false;
+	}
+	if (spooled_bytes + size > MAX_SPOOLED_BYTES){
+		std::cout << "ERROR: too many attachments in flight." << std::endl;
+		return false;
+	}
+	attachment_spool* spool = new attachment_spool();
+	spool->pipe_fds[0] = spool->pipe_fds[1] = -1;
+	spool->size = size;
+	spool->received = 0;
+	spool->header = header;
+	spool->map = NULL;
+	spool->refs = 0;
+	if ((spool->memfd = memfd_create("whatsapp-attachment", MFD_CLOEXEC)) < 0){
+		std::cout << "ERROR: memfd_create " << errno << "." << std::endl;
+		delete spool;
+		return false;
+	}
+	spooled_bytes += size;
+	if (pipe2(spool->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0){
+		std::cout << "ERROR: pipe " << errno << "." << std::endl;
+		spool->pipe_fds[0] = spool->pipe_fds[1] = -1;
+		release_spool(spool);
+		return false;
+	}
+	for (unsigned int i = 0; i < recipients.size(); i ++){
+		spool->recipients.push_back(std::make_pair(recipients[i],
+		                                           socketsToSessions[recipients[i]]->trace_id));
+	}
 
-			client_msg = SEND_SUCCESS_MSG;
-			// Success message to the sender.
-			if (send(sender_sock, client_msg.c_str(), client_msg.length(), 0) < 0) {
-				std::cout << "ERROR: send " << errno << "." << std::endl;
-				return;
-			}
+	size_t buffered = std::min(session->inbuf.length(), size);
+	if (buffered > 0 && pwrite(spool->memfd, session->inbuf.data(), buffered, 0) != (ssize_t) buffered){
+		std::cout << "ERROR: write " << errno << "." << std::endl;
+		release_spool(spool);
+		return false;
+	}
+	session->inbuf.erase(0, buffered);
+	spool->received = buffered;
+	socketsToUploads[sender_sock] = spool;
+	return true;
+}
+
+/**
+ * All the bytes of an attachment arrived - queue it for every receiver that is still connected,
+ * and ack the sender.
+ * @param sender_sock the sender socket.
+ */
+void finish_upload (int sender_sock)
+{
+	attachment_spool* spool = socketsToUploads[sender_sock];
+	socketsToUploads.erase(sender_sock);
+	for (int i = 0; i < 2; i ++){
+		close(spool->pipe_fds[i]);
+		spool->pipe_fds[i] = -1;
+	}
+	void* map = mmap(NULL, spool->size, PROT_READ, MAP_SHARED, spool->memfd, 0);
+	spool->map = map == MAP_FAILED ? NULL : static_cast<char*>(map);
+
+	for (unsigned int i = 0; i < spool->recipients.size(); i ++){
+		int sock = spool->recipients[i].first;
+		sessions_map::iterator it = socketsToSessions.find(sock);
+		if (it == socketsToSessions.end() || it->second->trace_id != spool->recipients[i].second ||
+		    (it->second->transport == TRANSPORT_SHM && spool->map == NULL)){
+			continue; // Gone (maybe its socket number was reused), or we can't reach its ring.
+		}
+		attachment_delivery delivery = {spool, 0, false};
+		socketsToDeliveries[sock].push_back(delivery);
+		spool->refs++;
+	}
+	if (spool->refs == 0){
+		release_spool(spool);
+	}
+	if (send_to_client(sender_sock, ATTACH_SENT_MSG, strlen(ATTACH_SENT_MSG)) < 0){
+		std::cout << "ERROR: send " << errno << "." << std::endl;
+	}
+}
 
-			std::cout << sender + ": \"" + command.substr(command.find(" ") + 1)
-			             + "\" was sent successfully to " + receiver + "." << std::endl;
-			break;
+/**
+ * Move the next part of an attachment, up to the budget of one pass, from the sender socket to
+ * its spool (socket -> pipe -> memory file, with splice).
+ * @param session the sender session.
+ * @param readable true if select reported the socket as readable.
+ * @return false if the sender disconnected (its session is gone), true otherwise.
+ */
+bool pump_upload (client_session* session, bool readable)
+{
+	int sock = session->sock;
+	attachment_spool* spool = socketsToUploads[sock];
+	if (spool->received < spool->size && readable){
+		int available = 0;
+		if (ioctl(sock, FIONREAD, &available) < 0 || available <= 0){ // Readable and empty - closed.
+			std::cout << "ERROR: the attachment of " << session->name << " was cut." << std::endl;
+			unregister_client(session->name);
+			remove_client_socket(sock);
+			return false;
 		}
-		default: // not exist
-		{
-			std::cout << sender + ": ERROR: failed to send \"" + msg + "\" to " + receiver + "."
-			          << std::endl;
-			std::string error_msg = SEND_ERR_MSG;
-			if (send(sender_sock, error_msg.c_str(), error_msg.length(), 0) < 0) {
-				std::cout << "ERROR: send " << errno << "." << std::endl;
-				return;
+		size_t length = std::min(std::min((size_t) available, spool->size - spool->received),
+		                         (size_t) ATTACH_BUDGET_BYTES);
+		ssize_t moved = splice(sock, NULL, spool->pipe_fds[1], NULL, length,
+		                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		loff_t offset = spool->received;
+		while (moved > 0){
+			ssize_t written = splice(spool->pipe_fds[0], NULL, spool->memfd, &offset, moved,
+			                         SPLICE_F_MOVE);
+			if (written <= 0){
+				break;
 			}
-			break;
+			moved -= written;
+		}
+		if (moved != 0 && !(moved < 0 && errno == EAGAIN)){
+			std::cout << "ERROR: splice " << errno << "." << std::endl;
+			unregister_client(session->name);
+			remove_client_socket(sock);
+			return false;
 		}
+		spool->received = offset;
 	}
+	if (spool->received == spool->size){
+		finish_upload(sock);
+	}
+	return true;
 }
 
 /**
- * This function take care to operate the "create_group" request.
- * @param sender_sock the client file descriptor.
- * @param command the name of the group to create and it's members.
+ * Send a receiver the next part of the attachment it gets, up to the budget of one pass. The
+ * socket is made non blocking for the sendfile, so a slow receiver does not stall the loop.
+ * When an attachment ends, the messages that waited for it are sent.
+ * @param sock the receiver socket.
  */
-void server_create_group (int sender_sock, std::string command)
+void pump_deliveries (int sock)
 {
-	std::string sender = get_sender_name(sender_sock);
-	std::string groupName = command.substr(0, command.find(" "));
-	std::string members = command.substr(command.find(" ") + 1);
-
-	// If the group name is already exists (as a group name / client name).
-	// OR if a client wants to open a group for himself.
-	if (is_name_exist(groupName) != 0 || members.compare(sender) == 0){
-		std::string err_msg = CREATE_GRP_ERR + groupName + "\".";
-		std::cout << sender << ": " << err_msg << std::endl;
-		if (send(clientsToSockets[sender], err_msg.c_str(), err_msg.length(), 0) < 0) {
+	std::list<attachment_delivery>& deliveries = socketsToDeliveries[sock];
+	attachment_delivery& delivery = deliveries.front();
+	attachment_spool* spool = delivery.spool;
+	client_session* session = socketsToSessions[sock];
+	if (!delivery.header_sent && fanouts_in_flight > 0){ // Workers may be sending to the socket.
+		return;
+	}
+	if (!delivery.header_sent){
+		if (send_now(sock, spool->header.data(), spool->header.length()) < 0){
 			std::cout << "ERROR: send " << errno << "." << std::endl;
 		}
-		return;
+		delivery.header_sent = true;
 	}
 
-	// If no error - create group.
-	std::set<std::string> group_members;
-	std::stringstream stringStream(members);
-	std::string token;
-	while(getline(stringStream, token, ','))
-	{
-		// If the current member is a client of the server - we can add it to the group.
-		if (clientsToSockets.find(token) != clientsToSockets.end()){
-			group_members.insert(token);
+	if (!session->outbuf.empty()){ // The header (or earlier messages) must reach the client first.
+		return;
+	}
+	size_t length = std::min(spool->size - delivery.offset, (size_t) ATTACH_BUDGET_BYTES);
+	if (session->transport == TRANSPORT_SHM){
+		ssize_t written = shm_try_send(session->shm, spool->map + delivery.offset, length);
+		if (written < 0){
+			std::cout << "ERROR: write " << errno << "." << std::endl;
+			written = spool->size - delivery.offset;
 		}
-		// The current member is not a client of the server - error
-		else{
-			std::string err_msg = CREATE_GRP_ERR + groupName + "\".";
-			std::cout << sender << ": " << err_msg << std::endl;
-			err_msg += "\n";
-			if (send(clientsToSockets[sender], err_msg.c_str(), err_msg.length(), 0) < 0) {
-				std::cout << "ERROR: send " << errno << "." << std::endl;
-			}
-			return;
+		delivery.offset += written;
+	}
+	else{
+		int flags = fcntl(sock, F_GETFL);
+		fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+		off_t offset = delivery.offset;
+		ssize_t sent = sendfile(sock, spool->memfd, &offset, length);
+		fcntl(sock, F_SETFL, flags);
+		if (sent < 0 && errno != EAGAIN){ // The receiver is gone, the recv side will notice.
+			std::cout << "ERROR: sendfile " << errno << "." << std::endl;
+			offset = spool->size;
+			socketsToDeferred.erase(sock);
 		}
+		delivery.offset = offset;
+	}
+	if (delivery.offset < spool->size){
+		return;
 	}
-	group_members.insert(sender); // The sender is also a member in the group.
 
-	groupsToClients[groupName] = group_members;
-	std::string msg = "Group \"" + groupName + "\" was created successfully.";
-	std::cout << sender << ": " << msg << std::endl;
-	msg += "\n";
-	if (send(clientsToSockets[sender], msg.c_str(), msg.length(), 0) < 0) {
+	release_spool(spool);
+	deliveries.pop_front();
+	std::string deferred;
+	deferred.swap(socketsToDeferred[sock]);
+	if (deliveries.empty()){
+		socketsToDeliveries.erase(sock);
+		socketsToDeferred.erase(sock);
+	}
+	if (!deferred.empty() && send_now(sock, deferred.data(), deferred.length()) < 0){
 		std::cout << "ERROR: send " << errno << "." << std::endl;
 	}
 }
 
 /**
- * This function receive a client request, parse it and send it to the coorespond function to
- * handle it.
- * @param req the request.
- * @param curr_sock the socket file descriptor of the client.
+ * Add a connection to the ones to serve in this pass of the event loop, if it is not there yet.
+ * @param fd the connection socket.
+ */
+void add_work (int fd)
+{
+	if (!FD_ISSET(fd, &work_set)){
+		FD_SET(fd, &work_set);
+		work_fds.push_back(fd);
+	}
+}
+
+/**
+ * Add the connections that have work select does not report - requests left from the previous
+ * pass, an attachment that got all its bytes with its request, or a receiver on a shm ring that
+ * gets an attachment (the ring has no writable event).
+ * @return true if there are any - then the event loop must not block in select.
  */
-void handle_client_request (char* req, int curr_sock)
+bool add_pending_work ()
 {
-	std::string request = req;
-	request = request.substr(0, request.find(END_LINE));
-	std::string operation = request.substr(0, request.find(" "));
-	if (operation.compare(NAME) == 0){
-		std::string arguments = request.substr(request.find(" ") + 1);
-		add_new_client(curr_sock, arguments);
+	bool pending = !pendingSockets.empty();
+	for (std::set<int>::iterator it = pendingSockets.begin(); it != pendingSockets.end(); ++it){
+		add_work(*it);
 	}
-	else if (operation.compare(CREATE_GROUP) == 0){
-		std::string arguments = request.substr(request.find(" ") + 1);
-		server_create_group(curr_sock, arguments);
+	for (std::map<int, attachment_spool*>::iterator it = socketsToUploads.begin();
+	     it != socketsToUploads.end(); ++it){
+		if (it->second->received == it->second->size){
+			add_work(it->first);
+			pending = true;
+		}
 	}
-	else if (operation.compare(SEND) == 0){
-		std::string arguments = request.substr(request.find(" ") + 1);
-		server_send(curr_sock, arguments);
+	for (std::map<int, std::list<attachment_delivery>>::iterator it = socketsToDeliveries.begin();
+	     it != socketsToDeliveries.end(); ++it){
+		if (socketsToSessions[it->first]->transport == TRANSPORT_SHM){
+			add_work(it->first);
+			pending = true;
+		}
 	}
-	else if (operation.compare(WHO) == 0){
-		server_who(curr_sock);
+	return pending;
+}
+
+/**
+ * Add the connections select reported ready. A ready doorbell stands for its shm session, whose
+ * ring is read with the socket. The fd sets are scanned only up to the last ready fd.
+ * @param ready the number of ready fds select returned.
+ */
+void add_ready_work (int ready)
+{
+	for (int fd = 0; fd < fd_max && ready > 0; fd ++){
+		bool readable = FD_ISSET(fd, &read_fds), writable = FD_ISSET(fd, &write_fds);
+		if (!readable && !writable){
+			continue;
+		}
+		ready -= readable + writable;
+		std::map<int, int>::iterator bell = doorbellsToSockets.find(fd);
+		if (bell != doorbellsToSockets.end()){
+			shm_clear_doorbell(fd);
+			add_work(bell->second);
+		}
+		else if (socketsToSessions.count(fd)){
+			add_work(fd);
+		}
 	}
-	else if (operation.compare(EXIT) == 0){
-		server_exit(curr_sock);
+}
+
+/**
+ * Print the allocator statistics of the slab pools and the loop arena to the server stdout.
+ */
+void print_memory_stats ()
+{
+	for (int i = 0; i < SLAB_CLASSES; i ++){
+		const slab_pool& pool = slab_pools[i];
+		std::cout << "slab " << (SLAB_MIN_BLOCK << i) << "B: in_use " << pool.in_use << ", peak "
+		          << pool.peak << ", chunks " << pool.chunks.size() << ", allocs "
+		          << pool.total_allocs << std::endl;
 	}
+	std::cout << "large allocs: " << large_allocs << std::endl;
+	std::cout << "arena: chunks " << loop_arena.chunks.size() << ", high water "
+	          << loop_arena.high_water << "B, resets " << loop_arena.resets << std::endl;
+	std::cout << "sessions: " << socketsToSessions.size() << ", clients: "
+	          << clientsToSockets.size() << ", groups: " << groupsToClients.size() << std::endl;
+	std::cout << "history: conversations " << conversationsToHistory.size() << ", bytes "
+	          << history_bytes << " of " << history_bytes_cap << ", departed clients "
+	          << departedClients.size() << std::endl;
+	std::cout << "load: loop lag " << loop_lag_us << "us, queue depth " << queue_depth
+	          << ", shed " << shed_clients << ", refused " << refused_connections << std::endl;
+	std::cout << "attachments: uploads " << socketsToUploads.size() << ", receivers "
+	          << socketsToDeliveries.size() << ", spooled " << spooled_bytes << "B" << std::endl;
+	std::cout << "fan-out: threads " << fanout_threads << ", in flight " << fanouts_in_flight
+	          << ", background " << background_fanouts << std::endl;
 }
 
 /**
@@ -344,14 +809,21 @@ void handle_client_request (char* req, int curr_sock)
 void clear_all_data_struct(){
 
 	std::string exit_msg = "exit\n";
-	for (unsigned int i = 0; i < fds.size(); i ++){
-		if (send(fds[i], exit_msg.c_str(), exit_msg.length(), 0) < 0) {
+	for (sessions_map::iterator it = socketsToSessions.begin(); it != socketsToSessions.end(); ++it){
+		if (send_to_client(it->first, exit_msg.c_str(), exit_msg.length()) < 0) {
 			std::cout << "ERROR: send " << errno << "." << std::endl;
 		}
 	}
 
+	while (!socketsToSessions.empty()){
+		remove_client_socket(socketsToSessions.begin()->first);
+	}
 	fds.clear();
-
+	conversationsToHistory.clear();
+	historyLru.clear();
+	clientsToConversations.clear();
+	departedClients.clear();
+	departures.clear();
 	groupsToClients.clear();
 	clientsToSockets.clear();
 
@@ -359,6 +831,10 @@ void clear_all_data_struct(){
 	FD_ZERO(&read_fds);
 
 	close(welcome_socket);
+	if (unix_socket >= 0){
+		close(unix_socket);
+		unlink(unix_path.c_str());
+	}
 }
 
 /**
@@ -390,15 +866,21 @@ int establish_server_socket(char* port_num)
 	// this is our port number
 	server_address.sin_port = htons(atoi(port_num));
 
-	// create socket
-	if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+	// create socket - non-blocking, so the accept loop can drain the queue and stop at EAGAIN.
+	if ((server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
 		std::cout << "ERROR: socket " << errno << "." << std::endl;
 	}
+	// Connections we closed linger in TIME_WAIT on the port - don't let them block a new listener
+	// (after a hot restart that could not take the old one over).
+	int reuse = 1;
+	if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0){
+		std::cout << "ERROR: setsockopt " << errno << "." << std::endl;
+	}
 	if (bind(server_socket, (struct sockaddr*)&server_address, sizeof(struct sockaddr_in)) < 0) {
 		std::cout << "ERROR: bind " << errno << "." << std::endl;
 		close(server_socket);
 	}
-	if (listen(server_socket, MAX_PENDING_SOCKETS) == -1) { // max # of queued connects
+	if (listen(server_socket, listen_backlog) == -1) { // max # of queued connects
 		std::cout << "ERROR: listen " << errno << "." << std::endl;
 		close(server_socket);
 	}
@@ -406,158 +888,1191 @@ int establish_server_socket(char* port_num)
 }
 
 /**
- * This function add new client to the inner server's data structures.
- * @param current_socket - the new socket
- * @param client_name - the client name.
+ * Create the unix domain listener for clients that run on the server host.
+ * @param path the socket path (an old socket file in that path is removed).
+ * @return the listener file descriptor, or -1 on error.
  */
-void add_new_client (int current_socket, std::string client_name)
+int establish_unix_socket (const std::string& path)
 {
-	std::string newClient = client_name.substr(0, client_name.find(END_LINE));
+	struct sockaddr_un address;
+	int server_socket;
 
-	// The client is not already exist
-	if (clientsToSockets.find(newClient) == clientsToSockets.end())
-	{
-		clientsToSockets[newClient] = current_socket;
-		std::cout << newClient << CONNECTED << std::endl;
-		std::string success_msg = CON_SUCCEED;
-		if (send(current_socket, success_msg.c_str(), success_msg.length(), 0) < 0) {
-			std::cout << "ERROR: send " << errno << "." << std::endl;
-		}
+	memset(&address, 0, sizeof(struct sockaddr_un));
+	address.sun_family = AF_UNIX;
+	if (path.length() >= sizeof(address.sun_path)){
+		std::cout << "ERROR: unix socket path is too long." << std::endl;
+		return -1;
 	}
-	else // Client name is already exist
-	{
-		// Remove the socket file descriptor from all lists it's member in.
-		FD_CLR(current_socket, &clients_fds);
-		std::vector<int>::iterator it = std::find(fds.begin(), fds.end(), current_socket);
-		fds.erase(it);
+	strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+	unlink(path.c_str());
 
-		std::string catch_name = CATCH_NAME;
-		if (send(current_socket, catch_name.c_str(), catch_name.length(), 0) < 0) {
-			std::cout << "ERROR: send " << errno << "." << std::endl;
-		}
-		std::cout << CON_FAIL << std::endl;
+	if ((server_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+		std::cout << "ERROR: socket " << errno << "." << std::endl;
+		return -1;
+	}
+	if (bind(server_socket, (struct sockaddr*)&address, sizeof(struct sockaddr_un)) < 0 ||
+	    listen(server_socket, listen_backlog) == -1) {
+		std::cout << "ERROR: bind " << errno << "." << std::endl;
+		close(server_socket);
+		return -1;
 	}
+	return server_socket;
 }
 
 
 /**
- * Read the client message.
- * @param msg the buffer to accept the client message.
+ * Read what the client sent, up to the read budget of one pass, into its session input buffer.
+ * Nothing is read while the buffer still holds a whole request - a client that sends faster than
+ * its request budget is served waits in its socket buffer (or ring), not in our memory.
+ * @param session the client session.
+ * @param readable true if select reported the socket as readable.
+ * @return false if the client disconnected (its session is gone), true otherwise.
  */
-void recv_client_msg (char* msg, int client_socket)
+bool recv_client_data (client_session* session, bool readable)
 {
-	unsigned int b_count = 0; // counts bytes read
-	ssize_t br = 0  ; // bytes read this pass
+	int client_socket = session->sock;
+	char buf[READ_BUDGET_BYTES];
+	ssize_t br;
 
-	char * msg_p = msg;
-	char end = '\0';
-	while (end != '\n') {
-		br = (int) recv (client_socket, msg_p, MAX_MSG_LEN - b_count, 0);
-		if (br > 0) {
-			b_count += br;
-			msg_p += br;
-		}
-		if (br < 1) {
-			std::cout << "ERROR: recv " << errno << "." << std::endl;
-			if (br == 0){ // The socket was closed.
-				// Remove the socket file descriptor from all lists it's member in.
-				FD_CLR(client_socket, &clients_fds);
-				std::vector<int>::iterator it = std::find(fds.begin(), fds.end(), client_socket);
-				fds.erase(it);
-			}
-			return;
-		}
-		end = msg[b_count - 1];
+	if (has_whole_request(session)){
+		return true;
+	}
+	if (session->transport == TRANSPORT_SHM){ // The requests arrive on the ring.
+		br = shm_ring_read(session->shm.in, buf, READ_BUDGET_BYTES);
+		session->inbuf.append(buf, br);
+	}
+	if (!readable){
+		return true;
+	}
+
+	br = recv (client_socket, buf, READ_BUDGET_BYTES, MSG_DONTWAIT);
+	if (br > 0) {
+		session->inbuf.append(buf, br);
+		return true;
+	}
+	if (br < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+		return true;
 	}
+	std::cout << "ERROR: recv " << errno << "." << std::endl;
+	// The socket was closed - unregister the client and remove its socket from all lists.
+	unregister_client(session->name);
+	remove_client_socket(client_socket);
+	return false;
 }
 
 /**
- * This function accept a new client connection and handle client requests.
+ * Tell the clients we are shutting down, close them and the listener, and close the capture.
  */
-void accept_clients_connections ()
+void stop_server ()
 {
-	struct sockaddr_in client;
-	memset(&client, 0, sizeof(struct sockaddr_in));
-	int c = sizeof(struct sockaddr_in);
+	clear_all_data_struct();
+	trace_close();
+	close(welcome_socket);
+}
 
-	FD_ZERO(&clients_fds);
-	FD_ZERO(&read_fds);
-	FD_SET(welcome_socket, &clients_fds);
-	FD_SET(STDIN_FILENO, &clients_fds);
+/**
+ * SIGINT and SIGTERM - ring the stop doorbell, and the event loop shuts the server down like EXIT.
+ */
+void on_stop_signal (int sig)
+{
+	stop_signal = sig;
+	uint64_t one = 1;
+	if (write(stop_doorbell, &one, sizeof(one)) < 0){ // Can't happen - but don't ignore the signal.
+		trace_flush();
+		_exit(1);
+	}
+}
 
-	int new_socket;
-	int ret_val;
-	fd_max = welcome_socket + 1;
-	while (true)
-	{
-		read_fds = clients_fds;
+/**
+ * A crash - write out the buffered capture records (the handler was reset to the default, so the
+ * signal kills us when we return).
+ */
+void on_crash_signal (int sig)
+{
+	trace_flush();
+	raise(sig);
+}
 
-		ret_val = select(fd_max, &read_fds, NULL, NULL, NULL);
+/**
+ * Install the signal handlers - a stop signal shuts the server down from the event loop, and a
+ * crash still leaves the capture records that were buffered in the file.
+ * @return false if the stop doorbell can't be created.
+ */
+bool install_signal_handlers ()
+{
+	if ((stop_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 || stop_doorbell >= FD_SETSIZE){
+		std::cout << "ERROR: eventfd " << errno << "." << std::endl;
+		return false;
+	}
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	sigemptyset(&action.sa_mask);
+	action.sa_handler = on_stop_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	action.sa_handler = on_crash_signal;
+	action.sa_flags = SA_RESETHAND;
+	int crashes[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+	for (unsigned int i = 0; i < sizeof(crashes) / sizeof(crashes[0]); i ++){
+		sigaction(crashes[i], &action, NULL);
+	}
+	return true;
+}
 
-		if (ret_val < 0) // System call error
-		{
-			std::cout << "ERROR: select " << errno << "." << std::endl;
-		}
+/**
+ * Shut the server down on SIGINT or SIGTERM, like EXIT, and then die of the signal.
+ */
+void stop_on_signal ()
+{
+	stop_server();
+	std::cout << "Signal " << stop_signal << ": server is shutting down" << std::endl;
+	signal(stop_signal, SIG_DFL);
+	raise(stop_signal);
+	exit(1);
+}
 
-		if (FD_ISSET(welcome_socket, &read_fds)) { // New client is trying to connect the server.
-			// Connect new client.
-			new_socket = accept(welcome_socket, (struct sockaddr *)&client, (socklen_t*)&c);
+/**
+ * Handle a line that was typed on the server stdin.
+ */
+void handle_server_input ()
+{
+	std::string msg;
+	if (!getline(std::cin, msg)){ // stdin was closed - stop listening to it.
+		FD_CLR(STDIN_FILENO, &clients_fds);
+		return;
+	}
+	if (msg.compare(EXIT_SERVER) == 0){
+		stop_server();
+		std::cout << EXIT_SERVER_MSG;
+		exit(0);
+	}
+	if (msg.compare(STATS_SERVER) == 0){
+		print_memory_stats();
+	}
+	if (msg.compare(UPGRADE_SERVER) == 0){
+		hot_restart();
+	}
+}
+
+/**
+ * Tell a connection the server can not take it now, and when to try again.
+ * @param sock the connection socket.
+ * @param retry_after_ms the retry hint.
+ */
+void reject_connection (int sock, uint64_t retry_after_ms)
+{
+	std::ostringstream busy_msg;
+	busy_msg << SERVER_BUSY << retry_after_ms << " ms." << END_LINE;
+	// The connection is closed right after, so don't wait if its buffer is full.
+	send(sock, busy_msg.str().c_str(), busy_msg.str().length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	shutdown(sock, SHUT_WR);
+
+	// Closing with unread bytes (usually the name request) resets the connection, and the client
+	// may lose the hint - read what already arrived first.
+	char buf[MAX_MSG_LEN];
+	while (recv(sock, buf, sizeof(buf), MSG_DONTWAIT) > 0){
+	}
+}
 
-			if (new_socket < 0){
+/**
+ * Accept the new connections on one of the listeners and open their sessions. The listener is
+ * drained until it has no more connections, so a reconnect burst does not wait for many passes.
+ * @param listen_socket the listener that is ready.
+ * @param transport the transport of the listener.
+ */
+void accept_new_client (int listen_socket, int transport)
+{
+	while (true){
+		int new_socket = accept4(listen_socket, NULL, NULL, SOCK_CLOEXEC);
+		if (new_socket < 0){
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
 				std::cout << "ERROR: accept " << errno << "." << std::endl;
 			}
+			return;
+		}
+		if (socketsToSessions.size() >= max_connections || new_socket >= FD_SETSIZE){
+			refused_connections++;
+			reject_connection(new_socket, MIN_RETRY_AFTER_MS);
+			close(new_socket);
+			continue;
+		}
+		open_session(new_socket, transport);
+		claim_socket(new_socket, socketsToSessions[new_socket]);
+		listen_to_fd(new_socket); // because we need to receive the name from the client.
+	}
+}
+
+/**
+ * This function accept a new client connection and handle client requests.
+ */
+void accept_clients_connections ()
+{
+	FD_ZERO(&clients_fds);
+	FD_ZERO(&read_fds);
+	FD_SET(welcome_socket, &clients_fds);
+	FD_SET(STDIN_FILENO, &clients_fds);
 
-			if (new_socket > fd_max - 1){ // Update the max file descriptor.
-				fd_max = new_socket + 1;
+	int ret_val;
+	unsigned int first_fd = 0; // Rotates every pass, so no connection is always served first.
+	struct timeval no_wait, flush_wait;
+	struct timespec pass_start, pass_end;
+	fd_max = welcome_socket + 1;
+	if (unix_socket >= 0){
+		FD_SET(unix_socket, &clients_fds);
+		fd_max = std::max(fd_max, unix_socket + 1);
+	}
+	if (pool != NULL){
+		FD_SET(pool->doorbell, &clients_fds);
+		fd_max = std::max(fd_max, pool->doorbell + 1);
+	}
+	if (stop_doorbell >= 0){
+		FD_SET(stop_doorbell, &clients_fds);
+		fd_max = std::max(fd_max, stop_doorbell + 1);
+	}
+	for (unsigned int i = 0; i < fds.size(); i ++){ // Connections handed over by a hot restart.
+		FD_SET(fds[i], &clients_fds);
+		fd_max = std::max(fd_max, fds[i] + 1);
+	}
+	while (true)
+	{
+		read_fds = clients_fds;
+		work_fds.clear();
+		FD_ZERO(&work_set);
+		FD_ZERO(&write_fds); // Wait for room in the sockets that get an attachment or have a backlog.
+		for (std::map<int, std::list<attachment_delivery>>::iterator it = socketsToDeliveries.begin();
+		     it != socketsToDeliveries.end(); ++it){
+			FD_SET(it->first, &write_fds);
+		}
+
+		// Don't block if some connection still has requests from the previous pass.
+		// Wake up soon if a shm client has output waiting for room in its ring.
+		no_wait.tv_sec = 0;
+		no_wait.tv_usec = 0;
+		flush_wait.tv_sec = 0;
+		flush_wait.tv_usec = SHM_FLUSH_US;
+		queue_depth = pendingSockets.size();
+		bool busy = add_pending_work();
+		bool shm_backlog = false;
+		for (std::set<int>::iterator it = backlogSockets.begin(); it != backlogSockets.end(); ++it){
+			if (socketsToSessions[*it]->transport == TRANSPORT_SHM){
+				shm_backlog = true;
+				add_work(*it);
 			}
-			fds.push_back(new_socket);
-			FD_SET(new_socket, &clients_fds); // because we need to receive the name from the client.
-		}
-		else if (FD_ISSET(STDIN_FILENO, &read_fds)) { // Input from the server stdin.
-
-			std::string msg;
-			getline(std::cin, msg);
-			if (msg.compare(EXIT_SERVER) == 0){
-				clear_all_data_struct();
-				std::cout << EXIT_SERVER_MSG;
-				close(welcome_socket);
-				exit(0);
+			else{
+				FD_SET(*it, &write_fds);
 			}
 		}
-		else { // A new request arrive from one of the clients - to handle.
+		struct timeval* timeout = busy ? &no_wait : (shm_backlog ? &flush_wait : NULL);
+		if (timeout == NULL){ // Idle - the capture is written out before we sleep.
+			trace_flush();
+		}
+		ret_val = latency_select(fd_max, &read_fds, &write_fds, timeout, server_latency);
+		clock_gettime(CLOCK_MONOTONIC, &pass_start);
 
-			for(unsigned int i = 0; i < fds.size(); i ++){
-				if (FD_ISSET(fds[i], &read_fds)){
-					new_socket = fds[i]; // This is the socket we need to handle.
+		if (ret_val < 0) // System call error
+		{
+			if (errno != EINTR){ // A signal - its doorbell is read on the next pass.
+				std::cout << "ERROR: select " << errno << "." << std::endl;
+			}
+			FD_ZERO(&read_fds);
+			FD_ZERO(&write_fds);
+		}
+		if (stop_doorbell >= 0 && FD_ISSET(stop_doorbell, &read_fds)){ // SIGINT or SIGTERM.
+			stop_on_signal();
+		}
 
-					char msg [MAX_MSG_LEN];
-					// Initialize msg.
-					memset(msg, 0, sizeof(msg));
+		if (FD_ISSET(welcome_socket, &read_fds)) { // New client is trying to connect the server.
+			accept_new_client(welcome_socket, TRANSPORT_TCP);
+		}
+		if (unix_socket >= 0 && FD_ISSET(unix_socket, &read_fds)) { // A local client.
+			accept_new_client(unix_socket, TRANSPORT_UNIX);
+		}
+		if (FD_ISSET(STDIN_FILENO, &read_fds)) { // Input from the server stdin.
+			handle_server_input();
+		}
+		if (pool != NULL && FD_ISSET(pool->doorbell, &read_fds)) { // Background fan-outs ended.
+			finish_fanouts();
+		}
 
-					recv_client_msg(msg, new_socket);
- 					handle_client_request(msg, new_socket);
+		// Give every connection that has work one budget of reading and of requests, starting
+		// from a different connection every pass. Handling a request may remove sockets.
+		add_ready_work(ret_val);
+		for(unsigned int i = 0; i < work_fds.size(); i ++){
+			int fd = work_fds[(first_fd + i) % work_fds.size()];
+			sessions_map::iterator it = socketsToSessions.find(fd);
+			if (it == socketsToSessions.end()){ // Removed while handling an earlier connection.
+				continue;
+			}
+			if (backlogSockets.count(fd) &&
+			    (FD_ISSET(fd, &write_fds) || it->second->transport == TRANSPORT_SHM) &&
+			    !flush_output(it->second)){
+				continue;
+			}
+			if (socketsToDeliveries.count(fd) &&
+			    (FD_ISSET(fd, &write_fds) || it->second->transport == TRANSPORT_SHM)){
+				pump_deliveries(fd);
+			}
+			if (it->second->waiting){ // Leave its bytes in the socket until its fan-out ends.
+				continue;
+			}
+			if (socketsToUploads.count(fd)){ // The connection carries attachment bytes, not requests.
+				if (pump_upload(it->second, FD_ISSET(fd, &read_fds))){
+					update_pending(fd); // Requests may have come after the attachment.
 				}
+				continue;
+			}
+			if (recv_client_data(it->second, FD_ISSET(fd, &read_fds))){
+				serve_client_requests(fd);
 			}
 		}
+		first_fd++;
+		arena_reset();
+
+		clock_gettime(CLOCK_MONOTONIC, &pass_end);
+		loop_lag_us = (pass_end.tv_sec - pass_start.tv_sec) * 1000000 +
+		              (pass_end.tv_nsec - pass_start.tv_nsec) / 1000;
+		trace_flush_due(pass_end);
 	}
 }
 
+// ---------------------------------------- Background fan-out -------------------------------------
+
+/**
+ * Take a task for the given worker - its newest one, or else the oldest one of another worker.
+ * @return false if there are no tasks.
+ */
+bool take_task (unsigned int self, fanout_task& task)
+{
+	for (unsigned int i = 0; i < pool->workers.size(); i ++){
+		fanout_worker* worker = pool->workers[(self + i) % pool->workers.size()];
+		std::lock_guard<std::mutex> guard(worker->lock);
+		if (worker->tasks.empty()){
+			continue;
+		}
+		if (i == 0){
+			task = worker->tasks.back();
+			worker->tasks.pop_back();
+		}
+		else{
+			task = worker->tasks.front();
+			worker->tasks.pop_front();
+		}
+		std::lock_guard<std::mutex> idle(pool->idle_lock);
+		pool->queued--;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Hand a frame to a receiver without waiting for it - what does not fit in its socket buffer is
+ * appended to its outbuf, behind the output already queued there. Called under the socket lock.
+ * @return FANOUT_SENT, FANOUT_QUEUED, or FANOUT_FAILED if the receiver is gone or its outbuf is full.
+ */
+char fanout_enqueue (client_session* session, const std::string& frame)
+{
+	if (session->outbuf.length() + frame.length() > OUTBUF_MAX){
+		return FANOUT_FAILED;
+	}
+	size_t sent = 0;
+	if (session->outbuf.empty()){
+		ssize_t written = send(session->sock, frame.data(), frame.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (written < 0 && errno != EAGAIN){ // Gone - the loop will notice.
+			return FANOUT_FAILED;
+		}
+		sent = std::max(written, (ssize_t) 0);
+	}
+	if (sent == frame.length()){
+		return FANOUT_SENT;
+	}
+	session->outbuf.append(frame, sent, std::string::npos);
+	return FANOUT_QUEUED;
+}
+
+/**
+ * Send the frame of a job to the receivers of one task. The worker that ends the last task of the
+ * job hands it to the loop.
+ */
+void run_task (const fanout_task& task)
+{
+	fanout_job* job = task.job;
+	for (size_t i = task.begin; i < task.end; i ++){
+		const fanout_recipient& recipient = job->recipients[i];
+		std::lock_guard<std::mutex> guard(socket_locks[recipient.sock]);
+		job->outcome[i] = socket_owner[recipient.sock] == recipient.owner ?
+		                  fanout_enqueue(recipient.session, job->frame) : FANOUT_FAILED;
+	}
+	if (--job->tasks_left > 0){
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> guard(pool->done_lock);
+		pool->done.push_back(job);
+	}
+	uint64_t one = 1;
+	if (write(pool->doorbell, &one, sizeof(one)) < 0){
+		std::cout << "ERROR: write " << errno << "." << std::endl;
+	}
+}
+
+/**
+ * The loop of a fan-out worker.
+ * @param self the index of the worker.
+ */
+void fanout_worker_loop (unsigned int self)
+{
+	cpu_set_t cpus;
+	if (server_latency.enabled && server_latency.cpu >= 0 &&
+	    sched_getaffinity(0, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) > 1){
+		CPU_CLR(server_latency.cpu, &cpus); // Leave the CPU of the loop to the loop.
+		sched_setaffinity(0, sizeof(cpus), &cpus);
+	}
+	fanout_task task;
+	while (true){
+		if (take_task(self, task)){
+			run_task(task);
+			continue;
+		}
+		std::unique_lock<std::mutex> idle(pool->idle_lock);
+		while (pool->queued == 0){
+			pool->wakeup.wait(idle);
+		}
+	}
+}
+
+/**
+ * Start the fan-out workers.
+ * @param threads the number of workers.
+ * @return false if the workers could not be started.
+ */
+bool start_fanout_pool (unsigned int threads)
+{
+	pool = new fanout_pool();
+	pool->next_worker = 0;
+	pool->queued = 0;
+	if ((pool->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 || pool->doorbell >= FD_SETSIZE){
+		std::cout << "ERROR: eventfd " << errno << "." << std::endl;
+		if (pool->doorbell >= 0){
+			close(pool->doorbell);
+		}
+		delete pool;
+		pool = NULL;
+		return false;
+	}
+	for (unsigned int i = 0; i < threads; i ++){
+		pool->workers.push_back(new fanout_worker());
+	}
+	for (unsigned int i = 0; i < threads; i ++){
+		std::thread(fanout_worker_loop, i).detach();
+	}
+	fanout_threads = threads;
+	return true;
+}
+
+/**
+ * Fan a group message out on the workers. Receivers on a shm ring are sent to right away (the loop
+ * is the only writer of a ring), the rest is split into tasks. The sender waits for the end of the
+ * job, so its next messages can not pass this one.
+ * @param sender_sock the sender socket.
+ * @param recipients the sockets of the receivers.
+ * @param frame the message.
+ * @param ack the response to the sender when all the receivers have it.
+ * @return false if the fan-out must be sent inline.
+ */
+bool server_fan_out (int sender_sock, const std::vector<int>& recipients, const std::string& frame,
+                     const std::string& ack)
+{
+	if (pool == NULL || !socketsToDeliveries.empty()){ // Attachments must not interleave with it.
+		return false;
+	}
+	client_session* sender = socketsToSessions[sender_sock];
+	std::vector<client_session*> shm_recipients;
+	fanout_job* job = new fanout_job();
+	for (unsigned int i = 0; i < recipients.size(); i ++){
+		sessions_map::iterator it = socketsToSessions.find(recipients[i]);
+		if (it == socketsToSessions.end()){
+			continue;
+		}
+		if (it->second->transport == TRANSPORT_SHM){
+			shm_recipients.push_back(it->second);
+		}
+		else{
+			fanout_recipient recipient = {recipients[i], socket_owner[recipients[i]], it->second,
+			                              it->second->name};
+			job->recipients.push_back(recipient);
+		}
+	}
+	if (job->recipients.empty()){
+		delete job;
+		return false;
+	}
+	job->outcome.assign(job->recipients.size(), FANOUT_FAILED);
+	job->shm_delivered = 0;
+	for (unsigned int i = 0; i < shm_recipients.size(); i ++){
+		if (send_now(shm_recipients[i]->sock, frame.data(), frame.length()) < 0){
+			std::cout << "ERROR: send " << errno << "." << std::endl;
+			job->failed += shm_recipients[i]->name + ",";
+			continue;
+		}
+		job->shm_delivered++;
+	}
+
+	job->sender_sock = sender_sock;
+	job->sender_owner = socket_owner[sender_sock];
+	job->sender = sender->name;
+	job->request_id = request_id;
+	job->frame = frame;
+	job->ack = ack;
+	size_t tasks = (job->recipients.size() + FANOUT_TASK_SIZE - 1) / FANOUT_TASK_SIZE;
+	job->tasks_left = tasks;
+	sender->waiting = true;
+	fanouts_in_flight++;
+	background_fanouts++;
+	{
+		std::lock_guard<std::mutex> idle(pool->idle_lock);
+		pool->queued += tasks;
+	}
+	for (size_t i = 0; i < tasks; i ++){
+		fanout_task task = {job, i * FANOUT_TASK_SIZE,
+		                    std::min((i + 1) * FANOUT_TASK_SIZE, job->recipients.size())};
+		fanout_worker* worker = pool->workers[pool->next_worker];
+		pool->next_worker = (pool->next_worker + 1) % pool->workers.size();
+		std::lock_guard<std::mutex> guard(worker->lock);
+		worker->tasks.push_back(task);
+	}
+	pool->wakeup.notify_all();
+	return true;
+}
+
+/**
+ * Take the jobs the workers ended - flush what they queued, ack their senders (naming the
+ * receivers that did not get the message, if any) and let them send again.
+ */
+void finish_fanouts ()
+{
+	shm_clear_doorbell(pool->doorbell);
+	std::vector<fanout_job*> done;
+	{
+		std::lock_guard<std::mutex> guard(pool->done_lock);
+		done.swap(pool->done);
+	}
+	for (unsigned int i = 0; i < done.size(); i ++){
+		fanout_job* job = done[i];
+		fanouts_in_flight--;
+		size_t delivered = job->shm_delivered;
+		for (size_t j = 0; j < job->recipients.size(); j ++){
+			const fanout_recipient& recipient = job->recipients[j];
+			if (job->outcome[j] == FANOUT_FAILED){
+				job->failed += recipient.name + ",";
+				continue;
+			}
+			delivered++;
+			if (job->outcome[j] == FANOUT_QUEUED && socket_owner[recipient.sock] == recipient.owner){
+				backlogSockets.insert(recipient.sock);
+			}
+		}
+		WA_PROBE2(fanout__done, job->request_id, delivered);
+		std::string ack = job->ack;
+		if (!job->failed.empty()){
+			job->failed.erase(job->failed.length() - 1);
+			std::cout << job->sender << ": ERROR: failed to send to " << job->failed << "." << std::endl;
+			ack = send_failed_msg(job->failed);
+		}
+		sessions_map::iterator it = socketsToSessions.find(job->sender_sock);
+		if (it != socketsToSessions.end() && socket_owner[job->sender_sock] == job->sender_owner){
+			it->second->waiting = false;
+			update_pending(job->sender_sock);
+			if (send_to_client(job->sender_sock, ack.c_str(), ack.length()) < 0){
+				std::cout << "ERROR: send " << errno << "." << std::endl;
+			}
+		}
+		delete job;
+	}
+}
+
+// ------------------------------------------ Hot restart ------------------------------------------
+
+/**
+ * Append a number to a snapshot.
+ */
+void put_u32 (std::string& snapshot, uint32_t value)
+{
+	snapshot.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+/**
+ * Append a string (its length and its bytes) to a snapshot.
+ */
+void put_string (std::string& snapshot, const std::string& value)
+{
+	put_u32(snapshot, (uint32_t) value.length());
+	snapshot.append(value);
+}
+
+/**
+ * Read a number from a snapshot and advance the offset.
+ */
+uint32_t get_u32 (const std::string& snapshot, size_t& offset)
+{
+	uint32_t value = 0;
+	if (offset + sizeof(value) <= snapshot.length()){
+		memcpy(&value, snapshot.data() + offset, sizeof(value));
+	}
+	offset += sizeof(value);
+	return value;
+}
+
+/**
+ * Read a string from a snapshot and advance the offset.
+ */
+std::string get_string (const std::string& snapshot, size_t& offset)
+{
+	uint32_t length = get_u32(snapshot, offset);
+	std::string value = offset < snapshot.length() ? snapshot.substr(offset, length) : "";
+	offset += length;
+	return value;
+}
+
+/**
+ * Serialize the server state - the listeners, the sessions with their partial requests, the groups
+ * and the histories. The file descriptors are not part of the snapshot, they are collected in the
+ * order the snapshot refers to them and passed separately.
+ * @param handoff_fds the vector to collect the file descriptors to pass into.
+ * @return the snapshot.
+ */
+std::string build_snapshot (std::vector<int>& handoff_fds)
+{
+	std::string snapshot;
+	put_u32(snapshot, SNAPSHOT_MAGIC);
+
+	handoff_fds.push_back(welcome_socket);
+	put_u32(snapshot, unix_socket >= 0);
+	if (unix_socket >= 0){
+		handoff_fds.push_back(unix_socket);
+		put_string(snapshot, unix_path);
+	}
+
+	put_u32(snapshot, (uint32_t) socketsToSessions.size());
+	for (sessions_map::iterator it = socketsToSessions.begin(); it != socketsToSessions.end(); ++it){
+		client_session* session = it->second;
+		handoff_fds.push_back(session->sock);
+		if (session->transport == TRANSPORT_SHM){
+			handoff_fds.push_back(session->shm_memfd);
+			handoff_fds.push_back(session->shm.in_fd);
+			handoff_fds.push_back(session->shm.out_fd);
+		}
+		put_u32(snapshot, (uint32_t) session->transport);
+		put_string(snapshot, session->name);
+		put_string(snapshot, std::string(session->inbuf.data(), session->inbuf.length()));
+	}
+
+	put_u32(snapshot, (uint32_t) groupsToClients.size());
+	for (groups_map::iterator it = groupsToClients.begin(); it != groupsToClients.end(); ++it){
+		put_string(snapshot, it->first);
+		put_u32(snapshot, (uint32_t) it->second.size());
+		for (members_set::iterator member = it->second.begin(); member != it->second.end(); ++member){
+			put_string(snapshot, *member);
+		}
+	}
+
+	// The least recently used conversation first, so the new LRU list is built in the same order.
+	put_u32(snapshot, (uint32_t) historyLru.size());
+	for (lru_list::reverse_iterator key = historyLru.rbegin(); key != historyLru.rend(); ++key){
+		const conversation_history& history = conversationsToHistory[*key];
+		put_string(snapshot, *key);
+		put_u32(snapshot, history.next_seq);
+		put_u32(snapshot, history.count);
+		put_string(snapshot, std::string(history.data.data() + history.start, history.data.length() - history.start));
+	}
+
+	// The clients that may still come back, the first to expire first.
+	std::vector<departed_map::iterator> departed;
+	for (departure_list::iterator it = departures.begin(); it != departures.end(); ++it){
+		departed.push_back(departedClients.find(it->second));
+	}
+	put_u32(snapshot, (uint32_t) departed.size());
+	for (unsigned int i = 0; i < departed.size(); i ++){
+		put_string(snapshot, departed[i]->first);
+		put_u32(snapshot, (uint32_t) departed[i]->second.expires);
+		put_u32(snapshot, (uint32_t) departed[i]->second.groups.size());
+		for (members_set::iterator group = departed[i]->second.groups.begin();
+		     group != departed[i]->second.groups.end(); ++group){
+			put_string(snapshot, *group);
+		}
+	}
+	return snapshot;
+}
+
+/**
+ * Send file descriptors over a unix domain socket, in batches the kernel accepts.
+ * @param sock the socket.
+ * @param handoff_fds the file descriptors.
+ * @return true on success.
+ */
+bool send_handoff_fds (int sock, const std::vector<int>& handoff_fds)
+{
+	char control[CMSG_SPACE(MAX_FDS_PER_MSG * sizeof(int))];
+	for (size_t sent = 0; sent < handoff_fds.size(); sent += MAX_FDS_PER_MSG){
+		size_t batch = std::min((size_t) MAX_FDS_PER_MSG, handoff_fds.size() - sent);
+		struct msghdr msg;
+		struct iovec iov;
+		char byte = 0;
+		memset(&msg, 0, sizeof(msg));
+		memset(control, 0, sizeof(control));
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &handoff_fds[sent], batch * sizeof(int));
+		if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0){
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Receive file descriptors that were sent by send_handoff_fds.
+ * @param sock the socket.
+ * @param count the number of file descriptors to receive.
+ * @param handoff_fds the vector to fill.
+ * @return true on success.
+ */
+bool recv_handoff_fds (int sock, size_t count, std::vector<int>& handoff_fds)
+{
+	char control[CMSG_SPACE(MAX_FDS_PER_MSG * sizeof(int))];
+	while (handoff_fds.size() < count){
+		struct msghdr msg;
+		struct iovec iov;
+		char byte;
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sock, &msg, 0) <= 0){
+			return false;
+		}
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS){
+			return false;
+		}
+		size_t batch = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int* received = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+		handoff_fds.insert(handoff_fds.end(), received, received + batch);
+	}
+	return true;
+}
+
+/**
+ * Write a whole buffer to a socket.
+ * @return true on success.
+ */
+bool send_all (int sock, const char* data, size_t length)
+{
+	while (length > 0){
+		ssize_t sent = send(sock, data, length, MSG_NOSIGNAL);
+		if (sent < 0){
+			return false;
+		}
+		data += sent;
+		length -= sent;
+	}
+	return true;
+}
+
+/**
+ * Read a whole buffer from a socket.
+ * @return true on success.
+ */
+bool recv_all (int sock, char* data, size_t length)
+{
+	while (length > 0){
+		ssize_t br = recv(sock, data, length, 0);
+		if (br <= 0){
+			return false;
+		}
+		data += br;
+		length -= br;
+	}
+	return true;
+}
+
+/**
+ * The "UPGRADE" command - hand the server over to a newly started binary without disconnecting
+ * anyone. This process execs the binary in the path it was started from, with the same arguments,
+ * so it keeps its PID, its supervisor and its stdin. A forked copy of the old state sends the new
+ * binary the state snapshot and every listener and client socket over a socket pair, then exits -
+ * whether the new binary took them or not, so the server always stays under this PID. If the exec
+ * fails this process keeps serving.
+ */
+void hot_restart ()
+{
+	if (!socketsToUploads.empty() || !socketsToDeliveries.empty()){ // Not in the snapshot.
+		std::cout << "ERROR: attachments are being transferred, try again later." << std::endl;
+		return;
+	}
+	if (fanouts_in_flight > 0 || has_output_backlog()){ // Not in the snapshot either.
+		std::cout << "ERROR: messages are being sent, try again later." << std::endl;
+		return;
+	}
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	trace_flush();
+
+	std::vector<int> handoff_fds;
+	std::string snapshot = build_snapshot(handoff_fds);
+
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0){
+		std::cout << "ERROR: socketpair " << errno << "." << std::endl;
+		return;
+	}
+	std::cout.flush();
+	pid_t pid = fork();
+	if (pid < 0){
+		std::cout << "ERROR: fork " << errno << "." << std::endl;
+		close(pair[0]);
+		close(pair[1]);
+		return;
+	}
+	if (pid == 0){ // The copy of the old state - hand it to the new binary, which replaces our parent.
+		close(pair[1]);
+		uint64_t header[3];
+		header[0] = (uint64_t) start.tv_sec * 1000000000 + start.tv_nsec; // For the pause measurement.
+		header[1] = snapshot.length();
+		header[2] = handoff_fds.size();
+		char ack;
+		if (send_all(pair[0], reinterpret_cast<char*>(header), sizeof(header)) &&
+		    send_all(pair[0], snapshot.data(), snapshot.length()) &&
+		    send_handoff_fds(pair[0], handoff_fds) && recv_all(pair[0], &ack, 1)){
+			_exit(0);
+		}
+		_exit(1); // The exec failed (the parent serves on) or the new binary started without us.
+	}
+	close(pair[0]);
+
+	// The new binary gets only stdio and the handoff socket - the rest comes over the socket.
+	close_range(STDERR_FILENO + 1, ~0U, CLOSE_RANGE_CLOEXEC);
+	fcntl(pair[1], F_SETFD, 0);
+	std::vector<char*> args;
+	for (unsigned int i = 0; i < server_args.size(); i ++){
+		args.push_back(const_cast<char*>(server_args[i].c_str()));
+	}
+	std::string inherit_opt = INHERIT_OPT;
+	std::string handoff_fd = std::to_string(pair[1]);
+	args.push_back(const_cast<char*>(inherit_opt.c_str()));
+	args.push_back(const_cast<char*>(handoff_fd.c_str()));
+	args.push_back(NULL);
+	execv(server_binary.c_str(), &args[0]);
+
+	std::cout << "ERROR: execv " << errno << "." << std::endl;
+	std::cout << UPGRADE_ERR_MSG << std::endl;
+	close(pair[1]); // The copy sees the socket close, and exits.
+	waitpid(pid, NULL, 0);
+}
+
+/**
+ * Give up the state a hot restart sends, before any of it was used: close what was received, and
+ * wait for the copy of the old state to exit, so its listeners are closed too.
+ * @param sock the handoff socket.
+ * @param handoff_fds the received file descriptors.
+ */
+void abandon_snapshot (int sock, const std::vector<int>& handoff_fds)
+{
+	close(sock);
+	for (unsigned int i = 0; i < handoff_fds.size(); i ++){
+		close(handoff_fds[i]);
+	}
+	wait(NULL);
+	welcome_socket = -1;
+	unix_socket = -1;
+}
+
+/**
+ * Rebuild the server state from the snapshot a hot restart sends (the new binary side). A session
+ * whose file descriptors are missing or unusable is closed, and its client is treated as gone.
+ * @param sock the handoff socket.
+ * @return false if nothing could be taken over (nothing was restored then).
+ */
+bool restore_snapshot (int sock)
+{
+	uint64_t header[3];
+	std::vector<int> handoff_fds;
+	if (!recv_all(sock, reinterpret_cast<char*>(header), sizeof(header)) || header[2] > MAX_HANDOFF_FDS){
+		abandon_snapshot(sock, handoff_fds);
+		return false;
+	}
+	std::string snapshot(header[1], '\0');
+	if ((header[1] > 0 && !recv_all(sock, &snapshot[0], header[1])) ||
+	    !recv_handoff_fds(sock, header[2], handoff_fds)){
+		abandon_snapshot(sock, handoff_fds);
+		return false;
+	}
+
+	size_t offset = 0;
+	size_t next_fd = 0;
+	if (get_u32(snapshot, offset) != SNAPSHOT_MAGIC){
+		abandon_snapshot(sock, handoff_fds);
+		return false;
+	}
+	bool has_unix = get_u32(snapshot, offset) != 0;
+	if (handoff_fds.size() < (has_unix ? 2 : 1)){ // The listeners.
+		abandon_snapshot(sock, handoff_fds);
+		return false;
+	}
+	welcome_socket = handoff_fds[next_fd++];
+	if (has_unix){
+		unix_socket = handoff_fds[next_fd++];
+		unix_path = get_string(snapshot, offset);
+	}
+
+	std::vector<std::string> dropped; // The clients whose sessions could not be taken over.
+	uint32_t sessions = get_u32(snapshot, offset);
+	for (uint32_t i = 0; i < sessions && offset < snapshot.length(); i ++){
+		uint32_t transport = get_u32(snapshot, offset);
+		std::string name = get_string(snapshot, offset);
+		std::string inbuf = get_string(snapshot, offset);
+		size_t session_fds = transport == TRANSPORT_SHM ? 4 : 1; // The socket, the memfd, 2 doorbells.
+		if (next_fd + session_fds > handoff_fds.size()){
+			dropped.push_back(name);
+			continue;
+		}
+		const int* fd = &handoff_fds[next_fd];
+		next_fd += session_fds;
+		bool usable = transport <= TRANSPORT_SHM && fd[0] < FD_SETSIZE;
+		shm_endpoint shm;
+		memset(&shm, 0, sizeof(shm));
+		if (usable && transport == TRANSPORT_SHM){
+			usable = fd[2] < FD_SETSIZE && shm_map(shm, fd[1], true);
+		}
+		if (!usable){
+			for (size_t j = 0; j < session_fds; j ++){
+				close(fd[j]);
+			}
+			dropped.push_back(name);
+			continue;
+		}
+
+		int client_socket = fd[0];
+		open_session(client_socket, (int) transport);
+		client_session* session = socketsToSessions[client_socket];
+		claim_socket(client_socket, session);
+		session->name = name;
+		session->inbuf.assign(inbuf.data(), inbuf.length());
+		if (!session->name.empty()){
+			clientsToSockets[session->name] = client_socket;
+		}
+		fds.push_back(client_socket);
+		if (session->transport == TRANSPORT_SHM){
+			session->shm = shm;
+			session->shm_memfd = fd[1];
+			session->shm.in_fd = fd[2];
+			session->shm.out_fd = fd[3];
+			doorbellsToSockets[session->shm.in_fd] = client_socket;
+			fds.push_back(session->shm.in_fd);
+		}
+		update_pending(client_socket); // It may have handed over whole requests.
+	}
+	for (size_t i = next_fd; i < handoff_fds.size(); i ++){ // More than the snapshot refers to.
+		close(handoff_fds[i]);
+	}
+
+	// The counts below are bounded by the snapshot length too, in case it was cut short.
+	uint32_t groups = get_u32(snapshot, offset);
+	for (uint32_t i = 0; i < groups && offset < snapshot.length(); i ++){
+		members_set& members = groupsToClients[get_string(snapshot, offset)];
+		uint32_t count = get_u32(snapshot, offset);
+		for (uint32_t j = 0; j < count && offset < snapshot.length(); j ++){
+			members.insert(get_string(snapshot, offset));
+		}
+	}
+
+	uint32_t conversations = get_u32(snapshot, offset);
+	for (uint32_t i = 0; i < conversations && offset < snapshot.length(); i ++){
+		std::string key = get_string(snapshot, offset);
+		conversation_history& history = conversationsToHistory[key];
+		history.next_seq = get_u32(snapshot, offset);
+		history.count = get_u32(snapshot, offset);
+		std::string data = get_string(snapshot, offset);
+		history.data.assign(data.data(), data.length());
+		historyLru.push_front(key);
+		history.lru = historyLru.begin();
+		history_bytes += history.data.length() + key.length() + HISTORY_CONV_OVERHEAD;
+		history_index(key, true);
+	}
+
+	uint32_t departed = get_u32(snapshot, offset);
+	for (uint32_t i = 0; i < departed && offset < snapshot.length(); i ++){
+		std::string name = get_string(snapshot, offset);
+		departed_client& record = departedClients[name];
+		record.expires = get_u32(snapshot, offset); // CLOCK_MONOTONIC is the same for the new binary.
+		uint32_t count = get_u32(snapshot, offset);
+		for (uint32_t j = 0; j < count && offset < snapshot.length(); j ++){
+			record.groups.insert(get_string(snapshot, offset));
+		}
+		record.departure = departures.insert(departures.end(), std::make_pair(record.expires, name));
+	}
+
+	for (unsigned int i = 0; i < dropped.size(); i ++){ // As if they disconnected.
+		if (!dropped[i].empty()){
+			clientsToSockets[dropped[i]] = -1;
+			unregister_client(dropped[i]);
+		}
+	}
+	if (!dropped.empty()){
+		std::cout << "ERROR: could not take over " << dropped.size() << " sessions." << std::endl;
+	}
+
+	char ack = 1;
+	if (!send_all(sock, &ack, 1)){ // The copy is gone - it does not serve, so carry on.
+		std::cout << "ERROR: send " << errno << "." << std::endl;
+	}
+	close(sock);
+	wait(NULL); // The copy of the old state exits once it has the ack.
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t pause_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec - header[0];
+	std::cout << "Hot restart: took over " << sessions << " sessions in " << pause_ns / 1000
+	          << " us." << std::endl;
+	return true;
+}
+
+/**
+ * Parse the optional arguments that follow the port number.
+ * @param argc the number of arguments.
+ * @param argv the arguments of the program.
+ * @return true if all the options are valid, false otherwise.
+ */
+bool parse_server_options (int argc, char *argv[])
+{
+	for (int i = VALID_ARG_NUM; i < argc; i ++){
+		std::string option = argv[i];
+		if (option.compare(CAPTURE_OPT) == 0 && i + 1 < argc){
+			if (!trace_open(argv[++i])){
+				std::cout << "ERROR: open " << errno << "." << std::endl;
+				return false;
+			}
+		}
+		else if (option.compare(UNIX_OPT) == 0 && i + 1 < argc){
+			unix_path = argv[++i];
+		}
+		else if (option.compare(HISTORY_MSGS_OPT) == 0 && i + 1 < argc){
+			history_msgs_cap = (unsigned int) strtoul(argv[++i], NULL, 10);
+		}
+		else if (option.compare(HISTORY_BYTES_OPT) == 0 && i + 1 < argc){
+			history_bytes_cap = (size_t) strtoull(argv[++i], NULL, 10);
+		}
+		else if (option.compare(HISTORY_GRACE_OPT) == 0 && i + 1 < argc){
+			history_grace_s = (unsigned int) strtoul(argv[++i], NULL, 10);
+		}
+		else if (option.compare(BACKLOG_OPT) == 0 && i + 1 < argc){
+			listen_backlog = atoi(argv[++i]);
+		}
+		else if (option.compare(MAX_CONNECTIONS_OPT) == 0 && i + 1 < argc){
+			max_connections = (unsigned int) strtoul(argv[++i], NULL, 10);
+		}
+		else if (option.compare(SHED_LAG_OPT) == 0 && i + 1 < argc){
+			shed_lag_ms = (unsigned int) strtoul(argv[++i], NULL, 10);
+		}
+		else if (option.compare(SHED_QUEUE_OPT) == 0 && i + 1 < argc){
+			shed_queue = (unsigned int) strtoul(argv[++i], NULL, 10);
+		}
+		else if (option.compare(INHERIT_OPT) == 0 && i + 1 < argc){
+			inherit_fd = atoi(argv[++i]);
+		}
+		else if (option.compare(FANOUT_THREADS_OPT) == 0 && i + 1 < argc){
+			fanout_threads = std::min((unsigned int) strtoul(argv[++i], NULL, 10),
+			                          (unsigned int) MAX_FANOUT_THREADS);
+		}
+		else if (option.compare(FANOUT_MIN_OPT) == 0 && i + 1 < argc){
+			parallel_fanout_min = (unsigned int) strtoul(argv[++i], NULL, 10);
+		}
+		else if (!latency_parse_option(server_latency, argc, argv, i)){
+			return false;
+		}
+	}
+	return true;
+}
+
 /**
  * The main function - responsible to run the whole flow of the server side.
  * @param argc the number of arguments.
- * @param argv the arguments of the program (port number).
+ * @param argv the arguments of the program (port number and options).
  * @return
  */
 int main(int argc, char *argv[])
 {
 	// Validity check.
-	if (argc != VALID_ARG_NUM) {
+	client_transport.send = socket_send;
+	client_transport.disconnect = remove_client_socket;
+	client_transport.reject = reject_connection;
+	client_transport.attach_shm = server_shm_attach;
+	client_transport.receive_attachment = server_receive_attachment;
+	client_transport.fan_out = server_fan_out;
+	fanout_threads = std::max(1U, std::min(std::thread::hardware_concurrency(),
+	                                       (unsigned int) MAX_FANOUT_THREADS));
+
+	// A receiver that is gone must not kill the server - sendfile can't take MSG_NOSIGNAL.
+	signal(SIGPIPE, SIG_IGN);
+
+	if (argc < VALID_ARG_NUM || !parse_server_options(argc, argv)) {
 		std::cout << INVALID_ARG_MSG;
 		exit(1);
 	}
+	// Keep the arguments for a hot restart - without the capture (the new binary would truncate
+	// the file) and without the handoff socket of this start.
+	for (int i = 0; i < argc; i ++){
+		std::string arg = argv[i];
+		if (arg.compare(CAPTURE_OPT) == 0 || arg.compare(INHERIT_OPT) == 0){
+			i++;
+			continue;
+		}
+		server_args.push_back(arg);
+	}
+	char binary[PATH_MAX];
+	ssize_t binary_length = readlink(SELF_EXE, binary, sizeof(binary) - 1);
+	server_binary = binary_length > 0 ? std::string(binary, binary_length) : std::string(argv[0]);
+	// The workers start before the loop is pinned, so they do not inherit its single CPU.
+	if (fanout_threads > 0 && parallel_fanout_min > 0 && !start_fanout_pool(fanout_threads)){
+		fanout_threads = 0;
+	}
+	if (!latency_apply(server_latency)){
+		std::cout << "ERROR: sched_setaffinity " << errno << "." << std::endl;
+	}
 
-	// Creating the server socket.
-	welcome_socket = establish_server_socket(argv[1]);
+	if (!install_signal_handlers()){
+		exit(1);
+	}
+
+	if (inherit_fd >= 0){ // A hot restart - take over the sockets of the old binary.
+		if (!restore_snapshot(inherit_fd)){ // Serve anyway, under the PID the supervisor knows.
+			std::cout << "ERROR: failed to restore the hot restart snapshot, starting empty." << std::endl;
+			inherit_fd = -1;
+		}
+	}
+	if (inherit_fd < 0){
+		// Creating the server socket.
+		welcome_socket = establish_server_socket(argv[1]);
+		// The accepted connections inherit the options of the listener (a hot restart hands it
+		// over with them).
+		if (!latency_tune_socket(welcome_socket, server_latency)){
+			std::cout << "ERROR: setsockopt " << errno << "." << std::endl;
+		}
+		if (!unix_path.empty() && (unix_socket = establish_unix_socket(unix_path)) < 0){
+			exit(1);
+		}
+	}
 
 	// The server accept connections.
 	accept_clients_connections();
@@ -0,0 +1,281 @@
+
+#ifndef WHATSAPP_SHM_H
+#define WHATSAPP_SHM_H
+
+// -------------------------------------------- Includes -------------------------------------------
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+// -------------------------------------------- Defines --------------------------------------------
+
+#define SHM_RING_SIZE (1 << 16) // Must be a power of two.
+#define SHM_ATTACH "shm" // The first request of a client that wants a shared-memory channel.
+#define SHM_ATTACH_REQUEST "shm\n"
+#define SHM_ATTACH_REFUSED "shm refused\n" // The reply, without fds, when there is no channel for us.
+#define SHM_FDS_NUM 3 // The memfd, the client->server doorbell and the server->client doorbell.
+#define SHM_SEND_TIMEOUT_MS 1000 // How long shm_send waits for a peer that does not drain its ring.
+
+// --------------------------------------------- Types ---------------------------------------------
+
+/**
+ * A single-producer single-consumer byte ring. head and tail count the bytes that were ever
+ * written and read, so head - tail is the number of unread bytes. They live on separate cache
+ * lines so the two processes don't bounce a line on every message.
+ */
+struct shm_ring {
+	std::atomic<uint32_t> head;
+	char head_pad[64 - sizeof(std::atomic<uint32_t>)];
+	std::atomic<uint32_t> tail;
+	char tail_pad[64 - sizeof(std::atomic<uint32_t>)];
+	char data[SHM_RING_SIZE];
+};
+
+/**
+ * The shared memory of one client: a ring for each direction.
+ */
+struct shm_channel {
+	shm_ring to_server;
+	shm_ring to_client;
+};
+
+/**
+ * One side of a shared-memory connection. The peer rings in_fd (an eventfd) after it writes to the
+ * incoming ring, and we ring out_fd after we write to the outgoing ring.
+ */
+struct shm_endpoint {
+	shm_channel* channel;
+	shm_ring* in;
+	shm_ring* out;
+	int in_fd;
+	int out_fd;
+};
+
+// ------------------------------------------- Functions -------------------------------------------
+
+/**
+ * Copy as many bytes as fit into the ring.
+ * @return the number of bytes that were written.
+ */
+inline size_t shm_ring_write (shm_ring* ring, const char* data, size_t len)
+{
+	uint32_t head = ring->head.load(std::memory_order_relaxed);
+	uint32_t tail = ring->tail.load(std::memory_order_acquire);
+	size_t space = SHM_RING_SIZE - (head - tail);
+	if (len > space){
+		len = space;
+	}
+	for (size_t i = 0; i < len; i ++){
+		ring->data[(head + i) & (SHM_RING_SIZE - 1)] = data[i];
+	}
+	ring->head.store(head + (uint32_t) len, std::memory_order_release);
+	return len;
+}
+
+/**
+ * Copy up to max unread bytes out of the ring.
+ * @return the number of bytes that were read.
+ */
+inline size_t shm_ring_read (shm_ring* ring, char* buf, size_t max)
+{
+	uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+	uint32_t head = ring->head.load(std::memory_order_acquire);
+	size_t len = head - tail;
+	if (len > max){
+		len = max;
+	}
+	for (size_t i = 0; i < len; i ++){
+		buf[i] = ring->data[(tail + i) & (SHM_RING_SIZE - 1)];
+	}
+	ring->tail.store(tail + (uint32_t) len, std::memory_order_release);
+	return len;
+}
+
+/**
+ * @return true if the ring has no unread bytes.
+ */
+inline bool shm_ring_empty (shm_ring* ring)
+{
+	return ring->head.load(std::memory_order_acquire) == ring->tail.load(std::memory_order_relaxed);
+}
+
+/**
+ * Consume the pending rings of a doorbell, so it is not readable until the peer rings it again.
+ */
+inline void shm_clear_doorbell (int fd)
+{
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) < 0){
+		return; // Nothing was pending (the doorbells are non-blocking).
+	}
+}
+
+/**
+ * Write what fits of a message to the outgoing ring and ring the peer's doorbell, like a non
+ * blocking send() on a socket.
+ * @return the number of bytes written (maybe 0 when the ring is full), -1 if the doorbell can't
+ * be rung.
+ */
+inline ssize_t shm_try_send (shm_endpoint& endpoint, const char* data, size_t len)
+{
+	uint64_t one = 1;
+	size_t written = shm_ring_write(endpoint.out, data, len);
+	if (written > 0 && write(endpoint.out_fd, &one, sizeof(one)) < 0){
+		return -1;
+	}
+	return (ssize_t) written;
+}
+
+/**
+ * Write a whole message to the outgoing ring and ring the peer's doorbell. When the ring is full we
+ * yield until the peer makes room, like a blocking send() on a socket - but only for
+ * SHM_SEND_TIMEOUT_MS, so a peer that died or stopped reading can't hang us.
+ * @return len on success, -1 if the doorbell can't be rung or the peer did not make room in time
+ * (errno is ETIMEDOUT).
+ */
+inline ssize_t shm_send (shm_endpoint& endpoint, const char* data, size_t len)
+{
+	size_t sent = 0;
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (sent < len){
+		ssize_t written = shm_try_send(endpoint, data + sent, len - sent);
+		if (written < 0){
+			return -1;
+		}
+		sent += written;
+		if (sent < len){
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >=
+			    SHM_SEND_TIMEOUT_MS){
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			sched_yield();
+		}
+	}
+	return (ssize_t) len;
+}
+
+/**
+ * Unmap the channel and close the doorbells of an endpoint.
+ */
+inline void shm_close (shm_endpoint& endpoint)
+{
+	if (endpoint.channel != NULL){
+		munmap(endpoint.channel, sizeof(shm_channel));
+		close(endpoint.in_fd);
+		close(endpoint.out_fd);
+		endpoint.channel = NULL;
+	}
+}
+
+/**
+ * Map a channel and set the endpoint rings for the given side.
+ * @param memfd the file that backs the channel.
+ * @param is_server true for the server side of the channel.
+ * @return true on success, false if the file can't be mapped or is too small for a channel.
+ */
+inline bool shm_map (shm_endpoint& endpoint, int memfd, bool is_server)
+{
+	struct stat file;
+	if (fstat(memfd, &file) < 0 || (size_t) file.st_size < sizeof(shm_channel)){ // It would fault.
+		return false;
+	}
+	void* mem = mmap(NULL, sizeof(shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (mem == MAP_FAILED){
+		return false;
+	}
+	endpoint.channel = static_cast<shm_channel*>(mem);
+	endpoint.in = is_server ? &endpoint.channel->to_server : &endpoint.channel->to_client;
+	endpoint.out = is_server ? &endpoint.channel->to_client : &endpoint.channel->to_server;
+	return true;
+}
+
+/**
+ * Send file descriptors with a one line message over a unix domain socket.
+ * @return true on success.
+ */
+inline bool shm_send_fds (int sock, const int* fds, const char* line)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(SHM_FDS_NUM * sizeof(int))];
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+
+	iov.iov_base = const_cast<char*>(line);
+	iov.iov_len = strlen(line);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(SHM_FDS_NUM * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, SHM_FDS_NUM * sizeof(int));
+	return sendmsg(sock, &msg, 0) >= 0;
+}
+
+/**
+ * The client side of the attach handshake: ask the server for a channel over the (unix domain)
+ * socket and map the channel it sends back.
+ * @param sock a socket that is connected to the server's unix domain listener.
+ * @return true on success. If the server refused, false with errno ECONNREFUSED - the socket is
+ *         still good to use without the channel.
+ */
+inline bool shm_attach (int sock, shm_endpoint& endpoint)
+{
+	if (send(sock, SHM_ATTACH_REQUEST, strlen(SHM_ATTACH_REQUEST), 0) < 0){
+		return false;
+	}
+
+	struct msghdr msg;
+	struct iovec iov;
+	char line[sizeof(SHM_ATTACH_REFUSED)];
+	char control[CMSG_SPACE(SHM_FDS_NUM * sizeof(int))];
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = line;
+	iov.iov_len = sizeof(line);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t br = recvmsg(sock, &msg, 0);
+	if (br <= 0){
+		return false;
+	}
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL){ // Refused - take the rest of the reply line, so the socket starts clean.
+		char last = line[br - 1];
+		while (last != '\n' && recv(sock, &last, 1, 0) == 1){
+		}
+		errno = ECONNREFUSED;
+		return false;
+	}
+	if (cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(SHM_FDS_NUM * sizeof(int))){
+		return false;
+	}
+	int fds[SHM_FDS_NUM];
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	bool mapped = shm_map(endpoint, fds[0], false);
+	close(fds[0]);
+	endpoint.out_fd = fds[1]; // client->server
+	endpoint.in_fd = fds[2]; // server->client
+	return mapped;
+}
+
+#endif // WHATSAPP_SHM_H
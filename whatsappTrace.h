@@ -0,0 +1,31 @@
+
+#ifndef WHATSAPP_TRACE_H
+#define WHATSAPP_TRACE_H
+
+// -------------------------------------------- Includes -------------------------------------------
+
+#include <stdint.h>
+
+// -------------------------------------------- Defines --------------------------------------------
+
+#define TRACE_MAGIC "WATRACE1" // The first bytes of every capture file.
+#define TRACE_MAGIC_LEN 8
+
+#define TRACE_OPEN 1 // A client connected.
+#define TRACE_FRAME 2 // A client sent a frame.
+#define TRACE_CLOSE 3 // A client disconnected (or was disconnected by the server).
+
+// --------------------------------------------- Types ---------------------------------------------
+
+/**
+ * The header of one record in a capture file. A TRACE_FRAME header is followed by length bytes of
+ * the frame, exactly as the server received it. All the fields are in the host byte order.
+ */
+struct trace_record {
+	uint64_t timestamp_us; // Microseconds since the capture started.
+	uint32_t conn_id; // Unique per connection for the whole capture (fds are reused).
+	uint16_t type;
+	uint16_t length;
+};
+
+#endif // WHATSAPP_TRACE_H